@@ -0,0 +1,69 @@
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define ACCESS_LOG_MAGIC "cSrvLog1"
+#define ACCESS_LOG_RING_SIZE 4096      // records buffered per worker, a power of two
+#define ACCESS_LOG_FLUSH_INTERVAL 100  // ms between writes of the buffered records
+#define ACCESS_LOG_CACHE_LINE 64
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // one request, as stored in the log file. All fields are in host byte order
+    typedef struct access_record
+    {
+        uint64_t timestamp;  // ns since the epoch, when the response was sent
+        uint64_t path_hash;  // hash64() of the request path, seed 0
+        uint8_t address[16]; // of the client. IPv4 addresses are mapped to IPv6
+        uint64_t bytes_sent;
+        uint32_t latency_us; // from the received request to the sent response
+        uint16_t status;     // HTTP status code, 0 if no response was sent
+        uint8_t method;      // http_method
+        uint8_t reserved;
+    } access_record;
+
+    // starts every log file, followed by the records
+    typedef struct access_log_header
+    {
+        char magic[8]; // ACCESS_LOG_MAGIC
+        uint32_t record_size;
+        uint32_t reserved;
+    } access_log_header;
+
+    /*
+     * Records of one worker on their way to the writer thread. The worker
+     * only moves head and the writer only moves tail, so neither locks.
+     */
+    typedef struct access_ring
+    {
+        uint64_t head __attribute__((aligned(ACCESS_LOG_CACHE_LINE))); // next record the worker writes
+        uint64_t dropped;                                             // records lost while the ring was full
+        uint64_t tail __attribute__((aligned(ACCESS_LOG_CACHE_LINE))); // next record the writer reads
+        access_record records[ACCESS_LOG_RING_SIZE];
+    } access_ring;
+
+    typedef struct access_log
+    {
+        int fd;
+        access_ring *rings; // one per worker
+        int num_rings;
+        pthread_t thread;
+        int running;
+    } access_log;
+
+    access_log *access_log_open(const char *path, int num_rings);
+    int access_log_append(access_log *log, int ring, const access_record *record);
+    uint64_t access_log_dropped(access_log *log);
+    void access_log_close(access_log *log);
+    void access_log_address(const struct sockaddr *addr, uint8_t *address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ACCESSLOG_H_
@@ -0,0 +1,37 @@
+#ifndef _ASSETS_H_
+#define _ASSETS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hashtable.h"
+
+#define ASSET_FINGERPRINT_LEN 10 // hex digits of the content hash in a fingerprinted name
+#define ASSET_MAX_AGE 31536000   // one year, the longest max-age clients are expected to honour
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /*
+     * Content fingerprints of the files below a directory, keyed by their
+     * path relative to it. The map is filled once and only read afterwards.
+     */
+    typedef struct asset_map
+    {
+        hashtable *table;
+        int num_assets;
+    } asset_map;
+
+    asset_map *asset_map_create(const char *root_dir);
+    const char *asset_fingerprint(asset_map *map, const char *file);
+    size_t asset_fingerprint_name(const char *name, const char *fingerprint, char *buffer, size_t size);
+    long asset_strip_fingerprint(asset_map *map, char *file, size_t len);
+    void asset_format_fingerprint(uint64_t hash, char *fingerprint);
+    int asset_hash_fd(int fd, char *fingerprint);
+    void asset_map_destroy(asset_map *map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ASSETS_H_
@@ -1,6 +1,8 @@
 #ifndef _FILES_H_
 #define _FILES_H_
 
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -10,6 +12,7 @@ extern "C"
         int size;
         void *data;
         char *filename;
+        time_t mtime; // last modification time, 0 if unknown
     } file_data;
     file_data *file_load(char *filename);
     void file_free(file_data *filedata);
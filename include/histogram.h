@@ -0,0 +1,41 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+// values are kept to 6 significant bits, within about 3% of what was recorded
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_BITS 40 // larger values are recorded as 2^40 - 1, about 18 minutes in ns
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /*
+     * Log-linear histogram in the style of HdrHistogram. Every power of two
+     * is split into the same number of buckets, so the relative error is
+     * the same for small and large values. A histogram has a single writer;
+     * any thread may read it while it is written, without locks.
+     */
+    typedef struct histogram
+    {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+    } histogram;
+
+    void histogram_record(histogram *hist, uint64_t value);
+    void histogram_add(histogram *hist, uint64_t value);
+    void histogram_merge(histogram *into, const histogram *from);
+    uint64_t histogram_percentile(const histogram *hist, double percentile);
+    double histogram_mean(const histogram *hist);
+    uint64_t histogram_bucket_limit(int bucket);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HISTOGRAM_H_
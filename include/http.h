@@ -0,0 +1,130 @@
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <stddef.h>
+#include <time.h>
+#include "picohttpparser.h"
+#include "pool.h"
+
+#define HTTP_MAX_HEADERS 100
+#define HTTP_DATE_SIZE 32
+#define HTTP_MAX_RANGES 16
+
+// content codings served from precompressed files
+#define HTTP_ENCODING_GZIP 0x1
+#define HTTP_ENCODING_BR 0x2
+#define HTTP_ENCODING_ALL (HTTP_ENCODING_GZIP | HTTP_ENCODING_BR)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef enum http_method
+    {
+        HTTP_METHOD_UNKNOWN = 0,
+        HTTP_METHOD_GET,
+        HTTP_METHOD_HEAD,
+        HTTP_METHOD_POST,
+        HTTP_METHOD_PUT,
+        HTTP_METHOD_DELETE,
+        HTTP_METHOD_CONNECT,
+        HTTP_METHOD_OPTIONS,
+        HTTP_METHOD_TRACE,
+        HTTP_METHOD_PATCH,
+        HTTP_METHOD_COUNT
+    } http_method;
+
+#define HTTP_METHOD_BIT(method) (1u << (method))
+
+    // headers that are indexed while the request is parsed
+    typedef enum http_header_id
+    {
+        HTTP_HEADER_HOST = 0,
+        HTTP_HEADER_USER_AGENT,
+        HTTP_HEADER_ACCEPT,
+        HTTP_HEADER_ACCEPT_ENCODING,
+        HTTP_HEADER_CONNECTION,
+        HTTP_HEADER_CONTENT_LENGTH,
+        HTTP_HEADER_CONTENT_TYPE,
+        HTTP_HEADER_COOKIE,
+        HTTP_HEADER_IF_MODIFIED_SINCE,
+        HTTP_HEADER_IF_NONE_MATCH,
+        HTTP_HEADER_IF_RANGE,
+        HTTP_HEADER_RANGE,
+        HTTP_HEADER_COUNT
+    } http_header_id;
+
+    // a byte range of a representation, both ends inclusive
+    typedef struct http_range
+    {
+        size_t start;
+        size_t end;
+    } http_range;
+
+    typedef struct http_param
+    {
+        const char *name;
+        size_t name_len;
+        const char *value;
+        size_t value_len;
+    } http_param;
+
+    /*
+     * A parsed request. Every string is a view into the request buffer and is
+     * valid until the handler returns. Views are not NUL terminated, except path.
+     */
+    typedef struct http_request
+    {
+        http_method method;
+        const char *method_name;
+        size_t method_len;
+        const char *path;
+        size_t path_len;
+        const char *query; // text after '?', not decoded. NULL if the request has no query
+        size_t query_len;
+        int minor_version;
+        struct phr_header *headers;
+        size_t num_headers;
+        const struct phr_header *indexed[HTTP_HEADER_COUNT];
+        const char *body; // body bytes that arrived along with the headers
+        size_t body_len;
+
+        arena *arena; // request lifetime memory. NULL to use the heap
+
+        // query parameters, decoded on first use by http_request_param()
+        http_param *params;
+        int num_params;
+        int params_decoded;
+        char *params_buffer;
+    } http_request;
+
+    http_method http_method_parse(const char *method, size_t method_len);
+    const char *http_method_name(http_method method);
+
+    void http_request_index_headers(http_request *request);
+    const struct phr_header *http_request_header(http_request *request, const char *name);
+    const struct phr_header *http_request_header_id(http_request *request, http_header_id id);
+    const char *http_request_param(http_request *request, const char *name, size_t *value_len);
+    int http_request_params(http_request *request, const http_param **params);
+    void http_request_cleanup(http_request *request);
+    long http_path_normalize(char *path, size_t path_len);
+    int http_request_not_modified(http_request *request, const char *etag, const char *last_modified, time_t mtime);
+    int http_request_range_applies(http_request *request, const char *etag, const char *last_modified);
+    int http_parse_range(const char *value, size_t len, size_t size, http_range *ranges, int max_ranges);
+    int http_request_accepted_encodings(http_request *request);
+    int http_encoding_preferred(int encodings);
+    const char *http_encoding_name(int encoding);
+    const char *http_encoding_extension(int encoding);
+
+    size_t http_format_date(time_t t, char *buffer);
+    const char *http_date_now(void);
+    time_t http_parse_date(const char *date, size_t len);
+
+    int http_parser_calibrate(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HTTP_H_
@@ -0,0 +1,86 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Contention statistics of a mutex. Build with make LOCKSTAT=1, which
+ * defines CSERVE_LOCKSTAT, to record them. Without it lockstat_lock() and
+ * lockstat_unlock() are plain pthread calls and the statistics stay zero.
+ * The structs holding them look the same either way, so applications built
+ * without the flag can use a library built with it.
+ */
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    typedef struct lock_stats
+    {
+        uint64_t acquisitions;
+        uint64_t contended; // acquisitions that found the mutex held
+        uint64_t wait_ns;   // spent waiting for the mutex
+        uint64_t hold_ns;   // the mutex was held
+        uint64_t acquired;  // ns, CLOCK_MONOTONIC, when the holder took the mutex
+    } lock_stats;
+
+    /* Adds the statistics of stats to total. stats may be changing meanwhile. */
+    static inline void lockstat_add(lock_stats *total, const lock_stats *stats)
+    {
+        total->acquisitions += __atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED);
+        total->contended += __atomic_load_n(&stats->contended, __ATOMIC_RELAXED);
+        total->wait_ns += __atomic_load_n(&stats->wait_ns, __ATOMIC_RELAXED);
+        total->hold_ns += __atomic_load_n(&stats->hold_ns, __ATOMIC_RELAXED);
+    }
+
+#ifdef CSERVE_LOCKSTAT
+    static inline uint64_t lockstat_now(void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    }
+
+    /* Locks mutex. Only a mutex that is held already costs the clock reads of the wait. */
+    static inline int lockstat_lock(pthread_mutex_t *mutex, lock_stats *stats)
+    {
+        uint64_t now;
+        if (pthread_mutex_trylock(mutex) != 0)
+        {
+            uint64_t start = lockstat_now();
+            int rv = pthread_mutex_lock(mutex);
+            if (rv != 0)
+            {
+                return rv;
+            }
+            now = lockstat_now();
+            // the fields only change under the mutex, but are read without it
+            __atomic_store_n(&stats->contended, stats->contended + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats->wait_ns, stats->wait_ns + now - start, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            now = lockstat_now();
+        }
+        __atomic_store_n(&stats->acquisitions, stats->acquisitions + 1, __ATOMIC_RELAXED);
+        stats->acquired = now;
+        return 0;
+    }
+
+    static inline int lockstat_unlock(pthread_mutex_t *mutex, lock_stats *stats)
+    {
+        __atomic_store_n(&stats->hold_ns, stats->hold_ns + lockstat_now() - stats->acquired, __ATOMIC_RELAXED);
+        return pthread_mutex_unlock(mutex);
+    }
+
+#else
+#define lockstat_lock(mutex, stats) pthread_mutex_lock(mutex)
+#define lockstat_unlock(mutex, stats) pthread_mutex_unlock(mutex)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LOCKSTAT_H_
@@ -0,0 +1,61 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#define LOG_LEVEL_OFF 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// statements above this level are compiled out. Build with make LOG_LEVEL=4 to keep debug messages
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RATE_LIMIT 10            // messages per second a call site may write, the rest are counted
+#define LOG_MESSAGE_SIZE 1024        // longest message, longer ones are cut
+#define LOG_BUFFER_SIZE (64 * 1024)  // bytes of messages waiting for the writer thread
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // rate limit state of one log statement
+    typedef struct log_site
+    {
+        long window;    // second the count belongs to
+        int count;      // messages in the window
+        int suppressed; // messages not written since the last written one
+    } log_site;
+
+    extern int log_level;
+
+    void log_set_level(int level);
+    void log_write(log_site *site, int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+    void log_start();
+    void log_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * Writes a printf style message if level is enabled, both at compile time and
+ * by log_set_level(). A disabled statement does not evaluate its arguments.
+ */
+#define log_message(level, ...)                                                                      \
+    do                                                                                               \
+    {                                                                                                \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) \
+        {                                                                                            \
+            static log_site log_site_ = {0, 0, 0};                                                   \
+            log_write(&log_site_, (level), __VA_ARGS__);                                             \
+        }                                                                                            \
+    } while (0)
+
+#define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_message(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif // _LOG_H_
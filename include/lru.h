@@ -2,7 +2,14 @@
 #define _LRU_H_
 
 #include <pthread.h>
+#include <time.h>
 #include "hashtable.h"
+#include "http.h"
+#include "lockstat.h"
+
+#define CACHE_ETAG_SIZE 24
+#define CACHE_MEMFD_MIN_SIZE (64 * 1024) // smaller contents stay on the heap, a memfd costs a descriptor and at least a page
+#define CACHE_MEMFD_FD_SHARE 4            // memfds use at most 1/CACHE_MEMFD_FD_SHARE of the descriptor limit
 
 #ifdef __cplusplus
 extern "C"
@@ -15,6 +22,20 @@ extern "C"
         int content_length;
         void *content;
 
+        // validators, computed once when the content enters the cache
+        time_t last_modified;
+        char last_modified_date[HTTP_DATE_SIZE];
+        char etag[CACHE_ETAG_SIZE]; // quoted hash of the content
+        int encodings;              // HTTP_ENCODING_* bits of the precompressed variants next to the file
+        int encoding;               // HTTP_ENCODING_* of the content itself, 0 unless it is a precompressed variant
+
+        // a ready to send response: status line and headers, followed by the content.
+        // NULL unless the node was serialized; content then points into it
+        char *response;
+        int header_length; // without the blank line, so per request headers can follow
+        int refcount;      // one for the cache, one for every request sending the node
+        int memfd;         // memfd holding the response, -1 if it is on the heap
+
         struct cache_node *next;
         struct cache_node *prev;
     } cache_node;
@@ -26,13 +47,22 @@ extern "C"
         cache_node *tail;
         int max_size;
         int current_size;
+        long num_evictions; // changed under mutex, readable without it
         pthread_mutex_t mutex;
+        lock_stats mutex_stats; // zero unless built with CSERVE_LOCKSTAT
     } lru;
     cache_node *allocate_node(char *key, char *content_path, void *content, int content_length);
     void free_cache_node(cache_node *node);
     lru *lru_create(int max_size, int hashsize);
     void destroy_cache(lru *lru_cache);
     cache_node *cache_put(lru *lru_cache, char *key, char *content_type, void *content, int content_length);
+    cache_node *cache_put_file(lru *lru_cache, char *key, char *content_type, void *content, int content_length, time_t last_modified);
+    cache_node *cache_put_node(lru *lru_cache, cache_node *node);
+    void cache_node_set_last_modified(cache_node *node, time_t last_modified);
+    int cache_node_set_response(cache_node *node, const char *header, int header_length);
+    int cache_node_set_memfd(cache_node *node);
+    void cache_retain(cache_node *node);
+    void cache_release(cache_node *node);
     cache_node *cache_get(lru *lru_cache, char *key);
     void cache_print(lru *lru_cache);
 #ifdef __cplusplus
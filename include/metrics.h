@@ -0,0 +1,17 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#define METRICS_DEFAULT_PATH "/metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    void metrics_response(void *server, int new_socket_fd, const char *path, void *args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _METRICS_H_
@@ -6,6 +6,7 @@ extern "C"
 {
 #endif
     char *mime_type_get(char *filename);
+    int mime_type_compressible(const char *mime_type);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,69 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define OUTPUT_IDLE_TIMEOUT 30 // seconds a queued connection may go without accepting a byte
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // bytes of a response that the socket did not accept yet
+    typedef struct output_segment
+    {
+        const char *data; // NULL for a file segment
+        int fd;           // file segments only, a duplicate owned by the segment
+        size_t offset;    // of the next byte to send, in data or fd
+        size_t length;    // bytes left to send
+        void (*release)(void *); // called once the segment is sent or dropped, for borrowed data
+        void *arg;
+        struct output_segment *next;
+    } output_segment;
+
+    /*
+     * The output of a non-blocking connection. Writes go straight to the
+     * socket while it accepts them; the rest is queued in order and sent when
+     * the socket becomes writable again.
+     */
+    typedef struct output_queue
+    {
+        int socket_fd;
+        output_segment *head;
+        output_segment *tail;
+        size_t queued_bytes;
+        time_t last_progress; // when the socket last accepted bytes from the queue
+        struct output_queue *next;
+        struct output_queue *prev;
+    } output_queue;
+
+    // sends the queues of all connections handed over by the workers, on one thread
+    typedef struct output_loop
+    {
+        int epoll_fd;
+        pthread_t thread;
+        int running;
+        pthread_mutex_t lock;
+        output_queue *queues;
+        int num_queues;
+    } output_loop;
+
+    void output_queue_init(output_queue *queue, int socket_fd);
+    long output_writev(output_queue *queue, struct iovec *iov, int iovcnt, int flags, int borrowed, void (*release)(void *), void *arg);
+    long output_sendfile(output_queue *queue, int fd, size_t offset, size_t length);
+    int output_pending(output_queue *queue);
+    int output_flush(output_queue *queue);
+    void output_discard(output_queue *queue);
+
+    output_loop *output_loop_create();
+    void output_loop_add(output_loop *loop, output_queue *queue);
+    void output_loop_destroy(output_loop *loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _OUTPUT_H_
@@ -80,6 +80,28 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
 /* returns if the chunked decoder is in middle of chunked data */
 int phr_decode_chunked_is_in_data(struct phr_chunked_decoder *decoder);
 
+/* character scanners the parser can use to skip over tokens */
+enum phr_simd {
+    PHR_SIMD_SCALAR = 0,
+    PHR_SIMD_SSE42,
+    PHR_SIMD_AVX2,
+    PHR_SIMD_COUNT
+};
+
+/* returns if the CPU running the process supports the scanner */
+int phr_simd_supported(int simd);
+
+/* switches the parser to the scanner, returns 0 if successful, -1 if the CPU
+ * does not support it. The widest supported scanner is selected when the
+ * library is loaded; switch only while no other thread is parsing */
+int phr_simd_select(int simd);
+
+/* returns the scanner currently in use */
+int phr_simd_current(void);
+
+/* returns the name of the scanner, e.g. "avx2" */
+const char *phr_simd_name(int simd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,48 @@
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#define CACHE_POLICY_HEADER_SIZE 96
+
+#define CACHE_POLICY_NO_CACHE 0x1  // clients must revalidate before every use
+#define CACHE_POLICY_NO_STORE 0x2  // clients must not keep the response at all
+#define CACHE_POLICY_IMMUTABLE 0x4 // the file never changes while it is fresh
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /*
+     * How long clients may keep a response. The Cache-Control line is
+     * formatted once, when the policy is configured.
+     */
+    typedef struct cache_policy
+    {
+        long max_age; // seconds, -1 if the policy has no max-age
+        int flags;    // CACHE_POLICY_* bits
+        char header[CACHE_POLICY_HEADER_SIZE]; // "Cache-Control: ...\n", empty while the policy is unset
+    } cache_policy;
+
+    // policies by file extension
+    typedef struct cache_policy_map
+    {
+        char **extensions; // lower case, without the leading dot
+        cache_policy *policies;
+        int num_policies;
+    } cache_policy_map;
+
+    int cache_policy_init(cache_policy *policy, long max_age, int flags);
+    size_t cache_policy_expires(const cache_policy *policy, time_t now, char *buffer, size_t size);
+
+    cache_policy_map *cache_policy_map_create();
+    int cache_policy_map_set(cache_policy_map *map, const char *extension, long max_age, int flags);
+    const cache_policy *cache_policy_map_get(cache_policy_map *map, const char *path);
+    void cache_policy_map_destroy(cache_policy_map *map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _POLICY_H_
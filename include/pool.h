@@ -0,0 +1,57 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /*
+     * Fixed size object pool. Objects are carved out of slabs and recycled
+     * through free lists. Only the owner thread may allocate. Any thread may
+     * free; those objects are handed back to the owner without locks.
+     */
+    typedef struct pool
+    {
+        size_t object_size;
+        int objects_per_slab;
+        void *free_list;   // owner thread only
+        void *remote_free; // objects freed by any thread, taken over in bulk by the owner
+        void *slabs;
+        long num_slabs;
+    } pool;
+
+    typedef struct arena_chunk
+    {
+        struct arena_chunk *next;
+    } arena_chunk;
+
+    /*
+     * Bump allocator for memory that lives as long as one request.
+     * arena_reset() releases everything at once.
+     */
+    typedef struct arena
+    {
+        char *buffer;
+        size_t size;
+        size_t used;
+        arena_chunk *large; // allocations that did not fit into buffer
+    } arena;
+
+    pool *pool_create(size_t object_size, int objects_per_slab);
+    void *pool_alloc(pool *pool_ptr);
+    void pool_free(pool *pool_ptr, void *object);
+    void pool_destroy(pool *pool_ptr);
+
+    arena *arena_create(size_t size);
+    void *arena_alloc(arena *arena_ptr, size_t size);
+    void arena_reset(arena *arena_ptr);
+    void arena_destroy(arena *arena_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _POOL_H_
@@ -1,6 +1,8 @@
 #ifndef _QUEUES_H_
 #define _QUEUES_H_
 
+#include "lockstat.h"
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -17,7 +19,11 @@ extern "C"
         queue_node *head;
         queue_node *tail;
         int size;
+        int max_size;     // most nodes ever queued at once
+        long num_enqueued; // nodes queued since the queue was created
+        queue_node *free_nodes; // dequeued nodes kept for reuse by enqueue
         pthread_mutex_t mutex;
+        lock_stats mutex_stats; // zero unless built with CSERVE_LOCKSTAT
         pthread_cond_t condition_var;
     } queues;
     queues *queue_create();
@@ -1,6 +1,17 @@
 #ifndef _ROUTES_H_
 #define _ROUTES_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include "http.h"
+#include "policy.h"
+#include "stats.h"
+
+#define ROUTE_ALLOW_HEADER_SIZE 96
+
+#define MOUNT_NO_CACHE 0
+#define MOUNT_CACHE 1 // files served from the mount are kept in the server's LRU cache
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -8,29 +19,69 @@ extern "C"
     typedef struct route_node
     {
         const char *key;
+        size_t key_len;
         const char *value;
         const char *route_dir;
         void (*route_fn)(void *, int, const char *, void *);
+        void (*request_fn)(void *, int, http_request *, const char *, void *);
         void *fn_args;
         char **methods;
         int num_methods;
+        unsigned int method_mask;                      // HTTP_METHOD_BIT() of every allowed method
+        char allow_header[ROUTE_ALLOW_HEADER_SIZE];    // precomputed "Allow: ..." line for 405 responses
+        int is_mount;                                  // node maps a path prefix onto a directory
+        int mount_flags;
+        cache_policy cache_policy;                     // Cache-Control of files served from the mount
+        char *owned_key, *owned_dir;                   // copies made for mounts, freed with the node
+        route_stats *stats;                            // requests served by the route, freed with the node
         struct route_node *left, *right;
     } route_node;
 
+    typedef struct route_slot
+    {
+        const char *key;
+        size_t key_len;
+        route_node *node;
+    } route_slot;
+
+    // immutable perfect hash over a set of route keys, built by route_freeze()
+    typedef struct route_hash
+    {
+        route_slot *slots;
+        uint32_t *displacements;
+        int num_slots;
+        int num_buckets;
+        uint64_t seed;
+    } route_hash;
+
     typedef struct route_map
     {
         route_node *map;
         int num_routes;
+        route_node *mounts;
+        int num_mounts;
+        size_t max_mount_len;
+        route_hash routes_hash;
+        route_hash mounts_hash;
+        int frozen;
     } route_map;
 
     route_map *route_create();
     void register_route(route_map *map, const char *key, const char *value, char **methods, size_t method_len, const char *route_dir, void (*route_fn)(void *, int, const char *, void *), void *fn_args);
+    void register_route_request(route_map *map, const char *key, char **methods, size_t method_len, const char *route_dir, void (*request_fn)(void *, int, http_request *, const char *, void *), void *fn_args);
     route_node *route_search(route_map *map, const char *key);
+    route_node *route_lookup(route_map *map, const char *key, size_t key_len);
+    void register_mount(route_map *map, const char *prefix, const char *dir, int flags);
+    route_node *route_match_mount(route_map *map, const char *path, size_t path_len);
+    route_node *route_find_mount(route_map *map, const char *prefix);
+    int route_freeze(route_map *map);
+    void route_thaw(route_map *map);
     void *route_delete(route_map *map, const char *key);
     void route_inorder_traversal(route_map *map);
+    void route_foreach(route_map *map, void (*fn)(route_node *node, void *arg), void *arg);
     void route_destroy(route_map *map);
     void route_node_print(route_node *node);
-    int route_check_method(route_node *node, char *method);
+    int route_check_method(route_node *node, http_method method);
 #ifdef __cplusplus
 }
 #endif
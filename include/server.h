@@ -3,9 +3,30 @@
 
 #include "lru.h"
 #include "routes.h"
+#include "policy.h"
+#include "assets.h"
+#include "zerocopy.h"
+#include "output.h"
+#include "stats.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "trace.h"
 
 #define HEADER_OK "HTTP/1.1 200 OK"
+#define HEADER_206 "HTTP/1.1 206 PARTIAL CONTENT"
+#define HEADER_304 "HTTP/1.1 304 NOT MODIFIED"
+#define HEADER_400 "HTTP/1.1 400 BAD REQUEST"
 #define HEADER_404 "HTTP/1.1 404 NOT FOUND"
+#define HEADER_405 "HTTP/1.1 405 METHOD NOT ALLOWED"
+#define HEADER_416 "HTTP/1.1 416 RANGE NOT SATISFIABLE"
+
+#define CACHE_STORAGE_HEAP 0  // cached files live in malloc'ed buffers
+#define CACHE_STORAGE_MEMFD 1 // cached files live in memfds and are sent with sendfile
+
+#define SERVER_MAX_QUEUES 64 // most connection queues server_queue_stats() reports
+
+#define HTTP_STREAM_SEGMENT_SIZE 16 * 1024 // small writes to a stream are coalesced into chunks of this size
+#define HTTP_STREAM_MAX_QUEUED 256 * 1024  // a stream waits while more than this is queued for a slow client
 
 #ifdef __cplusplus
 extern "C"
@@ -29,23 +50,99 @@ extern "C"
         int port;               // port number for the server
         lru *cache;             // cache ptr to LRU cache
         route_map *route_table; // store list of supported routes
+        cache_policy_map *cache_policies; // Cache-Control of static files by extension
+        asset_map *assets;                // content fingerprints of the files below server_root_dir
+        cache_policy asset_policy;        // Cache-Control of files requested by fingerprinted name
+        int cache_storage;                // CACHE_STORAGE_HEAP or CACHE_STORAGE_MEMFD
+        size_t zerocopy_threshold;        // cached files from this size on are sent with MSG_ZEROCOPY, 0 never
+        zerocopy_reaper *zerocopy;        // waits for MSG_ZEROCOPY completions while the server runs
+        output_loop *output;              // finishes the responses slow clients did not take in one go
+        server_stats *stats;              // counters and latency histograms of every worker
+        char *metrics_path;               // route reporting the statistics, NULL for none
+        struct queue_manager_ctx *queue_ctx; // connection queues of the workers, while the server runs
+        char *access_log_path;            // binary access log, NULL for none
+        access_log *access_log;           // open while the server runs
+        int trace_sample_rate;            // one in this many connections is traced, 0 for none
+        char *trace_path;                 // file the spans are written to on SIGUSR1
+        tracer *trace;                    // span buffers of the threads, while the server runs
         http_server_logs *server_logs;
         char *server_root_dir;
         long max_response_size;
         long max_request_size;
         int backlog;
         pthread_mutex_t lock;
+        // recorded with CSERVE_LOCKSTAT. The fields exist either way, so the layout does not depend on the flag
+        lock_stats lock_stats;       // of lock
+        lock_stats queue_lock_stats; // of the connection queues of earlier runs, added up
     } http_server;
 
+    /*
+     * A response whose body is sent while it is produced, without knowing its
+     * length. HTTP/1.1 clients get Transfer-Encoding: chunked. For HTTP/1.0
+     * clients the body ends when the connection closes.
+     */
+    typedef struct http_stream
+    {
+        http_server *server;
+        int socket_fd;
+        int chunked;
+        int failed;      // set once the client is gone. Later writes are dropped
+        long bytes_sent; // headers and chunk framing included
+        size_t length;   // bytes waiting in buffer
+        char buffer[HTTP_STREAM_SEGMENT_SIZE];
+    } http_stream;
+
+    // a queue of accepted connections and the workers taking them, see server_queue_stats()
+    typedef struct worker_queue_stats
+    {
+        int depth;         // connections waiting now
+        int max_depth;     // most connections ever waiting at once
+        long num_enqueued; // connections queued so far
+        int first_worker;  // rank of the first worker taking connections from the queue
+        int num_workers;
+        lock_stats lock;   // of the queue's mutex, zero unless built with CSERVE_LOCKSTAT
+    } worker_queue_stats;
+
+    // mutexes whose contention is recorded with CSERVE_LOCKSTAT
+    typedef enum server_lock
+    {
+        SERVER_LOCK_CACHE = 0, // mutex of the LRU cache
+        SERVER_LOCK_QUEUES,    // mutexes of all connection queues, added up
+        SERVER_LOCK_SERVER,    // lock of the server
+        SERVER_LOCK_COUNT
+    } server_lock;
+
     http_server *create_server(int port, int cache_size, int hashsize, char *root_dir, long max_request_size, long max_response_size, int backlog);
     void server_start(http_server *server, int close_server, int print_logs);
     void destroy_server(http_server *server, int print_logs);
     void print_server_logs(http_server *server);
 
     void server_route(http_server *server, const char *key, const char *value, char **methods, size_t method_len, const char *route_dir, void (*route_fn)(void *, int, const char *, void *), void *fn_args);
+    void server_route_request(http_server *server, const char *key, char **methods, size_t method_len, const char *route_dir, void (*request_fn)(void *, int, http_request *, const char *, void *), void *fn_args);
+    void server_mount(http_server *server, const char *prefix, const char *dir, int flags);
+    void server_mount_cache_control(http_server *server, const char *prefix, long max_age, int flags);
+    void server_extension_cache_control(http_server *server, const char *extension, long max_age, int flags);
+    void server_cache_storage(http_server *server, int storage);
+    void server_zerocopy_threshold(http_server *server, size_t threshold);
+    int server_fingerprint_assets(http_server *server);
+    void server_metrics(http_server *server, const char *path);
+    void server_access_log(http_server *server, const char *path);
+    void server_trace(http_server *server, int sample_rate, const char *path);
+    const route_stats *server_route_stats(http_server *server, const char *key);
+    int server_queue_stats(http_server *server, worker_queue_stats *queue_stats, int max_queues);
+    void server_lock_stats(http_server *server, server_lock lock, lock_stats *stats);
+    const char *server_lock_name(server_lock lock);
+    void server_queue_wait(http_server *server, int queue, histogram *merged);
+    const char *server_asset_url(http_server *server, const char *url, char *buffer, size_t size);
     void *handle_http_request(void *arg);
     int send_http_response(http_server *server, int new_socket_fd, char *header, char *content_type, char *body, size_t content_length);
+    int send_http_response_headers(http_server *server, int new_socket_fd, char *header, char *content_type, const char *extra_headers, char *body, size_t content_length);
+    int http_stream_begin(http_stream *stream, http_server *server, int new_socket_fd, char *header, char *content_type, const char *extra_headers);
+    int http_stream_write(http_stream *stream, const void *data, size_t length);
+    int http_stream_printf(http_stream *stream, const char *format, ...);
+    long http_stream_end(http_stream *stream);
     int file_response_handler(http_server *server, int new_socket_fd, char *path);
+    int file_response(http_server *server, int new_socket_fd, http_request *request, char *path, int use_cache, const cache_policy *policy);
     cache_node *server_cache_retreive(http_server *server, char *key);
     void server_cache_resource(http_server *server, char *key, char *content_type, void *data, size_t content_length);
 #ifdef __cplusplus
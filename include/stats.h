@@ -0,0 +1,81 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include "histogram.h"
+
+#define STATS_CACHE_LINE 64
+
+// stages of a request, timed by the worker handling it
+#define STATS_PARSE 0    // parsing the request line and headers
+#define STATS_SEARCH 1   // looking up the route or mount
+#define STATS_RESPONSE 2 // building and sending the response
+#define STATS_TOTAL 3    // from the received request to the sent response
+#define STATS_NUM_STAGES 4
+
+// counters kept by every worker
+#define STATS_REQUESTS 0
+#define STATS_GET_REQUESTS 1
+#define STATS_BYTES_RECEIVED 2
+#define STATS_BYTES_SENT 3
+#define STATS_NUM_COUNTERS 4
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /*
+     * What one worker measured. Only that worker writes it, so recording
+     * takes no locks; readers merge all workers when they need the numbers.
+     * Aligned so workers never share a cache line.
+     */
+    typedef struct worker_stats
+    {
+        uint64_t counters[STATS_NUM_COUNTERS];
+        histogram latency[STATS_NUM_STAGES]; // ns
+        histogram queue_wait;                // ns from accepting a connection until the worker picked it up
+    } __attribute__((aligned(STATS_CACHE_LINE))) worker_stats;
+
+    /*
+     * What all workers measured for one route or mount. Workers share it,
+     * so it is updated with atomic additions.
+     */
+    typedef struct route_stats
+    {
+        uint64_t requests;
+        uint64_t bytes_sent;
+        uint64_t cpu_ns;   // CPU time of the calling thread spent in the route's handler function
+        histogram latency; // of the response stage, ns
+    } route_stats;
+
+    typedef struct server_stats
+    {
+        worker_stats *workers;
+        int num_workers;
+    } server_stats;
+
+    // adds n to counter of the calling worker's stats. The store is atomic, the addition needs no lock
+    static inline void stats_count(worker_stats *stats, int counter, uint64_t n)
+    {
+        if (stats != NULL)
+        {
+            __atomic_store_n(&stats->counters[counter], stats->counters[counter] + n, __ATOMIC_RELAXED);
+        }
+    }
+
+    void route_stats_record(route_stats *stats, uint64_t bytes_sent, uint64_t latency_ns, uint64_t cpu_ns);
+
+    server_stats *server_stats_create(int num_workers);
+    worker_stats *server_stats_worker(server_stats *stats, int rank);
+    uint64_t server_stats_counter(server_stats *stats, int counter);
+    void server_stats_latency(server_stats *stats, int stage, histogram *merged);
+    void server_stats_queue_wait(server_stats *stats, int first_worker, int num_workers, histogram *merged);
+    const char *server_stats_stage_name(int stage);
+    void server_stats_print(server_stats *stats, FILE *stream);
+    void server_stats_destroy(server_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _STATS_H_
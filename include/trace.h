@@ -0,0 +1,100 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+#define TRACE_BUFFER_SPANS 8192 // spans kept per thread, a power of two. Older ones are overwritten
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    typedef enum trace_event
+    {
+        TRACE_ACCEPT = 0,
+        TRACE_ENQUEUE,
+        TRACE_DEQUEUE, // from accepting the connection until a worker took it
+        TRACE_REQUEST, // the worker handling the connection
+        TRACE_PARSE,
+        TRACE_ROUTE_LOOKUP,
+        TRACE_CACHE_LOOKUP,
+        TRACE_FILE_LOAD,
+        TRACE_HANDLER,
+        TRACE_SEND,
+        TRACE_EVENT_COUNT
+    } trace_event;
+
+    typedef struct trace_span
+    {
+        uint64_t start;    // ns, CLOCK_MONOTONIC
+        uint32_t duration; // ns
+        uint32_t request;  // id of the sampled request
+        uint16_t event;    // trace_event
+    } trace_span;
+
+    // spans of one thread. Only that thread writes; a dump reads concurrently
+    typedef struct trace_buffer
+    {
+        char name[32];
+        uint64_t head; // spans recorded so far
+        trace_span spans[TRACE_BUFFER_SPANS];
+    } trace_buffer;
+
+    typedef struct tracer
+    {
+        trace_buffer *buffers;
+        int num_buffers;
+        int sample_rate; // one in sample_rate connections is traced
+        long num_connections;
+        uint32_t next_request;
+    } tracer;
+
+    // buffer of the calling thread, NULL if it does not trace
+    extern __thread trace_buffer *trace_thread;
+    // sampled request the calling thread works on, 0 if none
+    extern __thread uint32_t trace_request;
+    // set by SIGUSR1 while tracing
+    extern volatile sig_atomic_t trace_dump_requested;
+
+    tracer *trace_create(int num_buffers, int sample_rate);
+    trace_buffer *trace_buffer_get(tracer *trace, int index, const char *name);
+    uint32_t trace_sample(tracer *trace);
+    void trace_record(trace_buffer *buffer, int event, uint32_t request, uint64_t start, uint64_t end);
+    int trace_dump(tracer *trace, const char *path);
+    void trace_signal_handler(int signum);
+    void trace_destroy(tracer *trace);
+
+    static inline uint64_t trace_ns(const struct timespec *ts)
+    {
+        return ts->tv_sec * 1000000000UL + ts->tv_nsec;
+    }
+
+    static inline uint64_t trace_now(void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return trace_ns(&ts);
+    }
+
+    /* Starts a span of the request the calling thread works on. Returns 0 if it is not sampled. */
+    static inline uint64_t trace_begin(void)
+    {
+        return trace_request != 0 ? trace_now() : 0;
+    }
+
+    /* Ends a span started by trace_begin(). */
+    static inline void trace_end(int event, uint64_t start)
+    {
+        if (start != 0)
+        {
+            trace_record(trace_thread, event, trace_request, start, trace_now());
+        }
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _TRACE_H_
@@ -0,0 +1,50 @@
+#ifndef _ZEROCOPY_H_
+#define _ZEROCOPY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define ZEROCOPY_DRAIN_TIMEOUT 2000 // ms to wait for outstanding completions when the reaper stops
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /*
+     * A socket with MSG_ZEROCOPY sends in flight. The buffers they reference
+     * must stay untouched until the kernel reports every send as completed.
+     */
+    typedef struct zerocopy_pending
+    {
+        int socket_fd;          // a duplicate, so the connection outlives the request
+        uint32_t num_sends;     // completions expected, one per successful send
+        uint32_t num_completed; // completions received so far
+        void (*done)(void *);   // called once all sends completed
+        void *arg;
+        struct zerocopy_pending *next;
+        struct zerocopy_pending *prev;
+    } zerocopy_pending;
+
+    // collects the completion notifications of all sockets on one thread
+    typedef struct zerocopy_reaper
+    {
+        int epoll_fd;
+        pthread_t thread;
+        int running;
+        pthread_mutex_t lock;
+        zerocopy_pending *pending;
+        int num_pending;
+    } zerocopy_reaper;
+
+    int zerocopy_enable(int socket_fd);
+    long zerocopy_send(int socket_fd, struct iovec *iov, int iovcnt, uint32_t *num_sends);
+    zerocopy_reaper *zerocopy_reaper_create();
+    void zerocopy_reaper_add(zerocopy_reaper *reaper, int socket_fd, uint32_t num_sends, void (*done)(void *), void *arg);
+    void zerocopy_reaper_destroy(zerocopy_reaper *reaper);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ZEROCOPY_H_
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "accesslog.h"
+
+#define ACCESS_LOG_BATCH 1024 // records written with one write()
+
+// writes all of size bytes of data. Returns 0, or -1 on error
+static int write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t rv = write(fd, data, size);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/* Moves the records waiting in every ring to the file. Returns the number of records written. */
+static long access_log_drain(access_log *log, access_record *batch)
+{
+    long written = 0;
+    for (int i = 0; i < log->num_rings; i++)
+    {
+        access_ring *ring = &log->rings[i];
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head)
+        {
+            int count = 0;
+            for (; tail != head && count < ACCESS_LOG_BATCH; tail++, count++)
+            {
+                batch[count] = ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+            }
+            // the slots are free for the worker again once the records are copied out
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            if (write_all(log->fd, (const char *)batch, count * sizeof(access_record)) < 0)
+            {
+                perror("Could not write the access log");
+            }
+            written += count;
+        }
+    }
+    return written;
+}
+
+static void *access_log_writer(void *arg)
+{
+    access_log *log = (access_log *)arg;
+    access_record *batch = (access_record *)malloc(ACCESS_LOG_BATCH * sizeof(access_record));
+    if (batch == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to the access log batch.\n");
+        return NULL;
+    }
+    struct timespec interval = {0, ACCESS_LOG_FLUSH_INTERVAL * 1000000L};
+    while (__atomic_load_n(&log->running, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&interval, NULL);
+        access_log_drain(log, batch);
+    }
+    // the workers stopped before the log is closed. Take what they left
+    access_log_drain(log, batch);
+    free(batch);
+    return NULL;
+}
+
+/*
+ * Opens path for appending and starts the thread writing to it. Every
+ * worker appends to a ring of its own, num_rings in total.
+ * Returns NULL on error.
+ */
+access_log *access_log_open(const char *path, int num_rings)
+{
+    access_log *log = (access_log *)malloc(sizeof(access_log));
+    if (log == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to access_log.\n");
+        return NULL;
+    }
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0)
+    {
+        fprintf(stderr, "Could not open the access log %s: %s\n", path, strerror(errno));
+        free(log);
+        return NULL;
+    }
+    // a new file starts with the header, so the dump tool can check the layout
+    if (lseek(log->fd, 0, SEEK_END) == 0)
+    {
+        access_log_header header = {{0}, sizeof(access_record), 0};
+        memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+        write_all(log->fd, (const char *)&header, sizeof(header));
+    }
+    if (posix_memalign((void **)&log->rings, ACCESS_LOG_CACHE_LINE, num_rings * sizeof(access_ring)) != 0)
+    {
+        fprintf(stderr, "Error allocating memory to the access log rings.\n");
+        close(log->fd);
+        free(log);
+        return NULL;
+    }
+    memset(log->rings, 0, num_rings * sizeof(access_ring));
+    log->num_rings = num_rings;
+    log->running = 1;
+    if (pthread_create(&log->thread, NULL, access_log_writer, log) != 0)
+    {
+        fprintf(stderr, "Could not start the access log writer.\n");
+        free(log->rings);
+        close(log->fd);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+/*
+ * Queues record for the writer. Only the worker owning ring may call this.
+ * A full ring drops the record rather than making the worker wait.
+ * Returns 0, or -1 if the record was dropped.
+ */
+int access_log_append(access_log *log, int ring_index, const access_record *record)
+{
+    access_ring *ring = &log->rings[ring_index];
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ACCESS_LOG_RING_SIZE)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    ring->records[head & (ACCESS_LOG_RING_SIZE - 1)] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Returns the number of records dropped so far because a ring was full. */
+uint64_t access_log_dropped(access_log *log)
+{
+    uint64_t dropped = 0;
+    for (int i = 0; log != NULL && i < log->num_rings; i++)
+    {
+        dropped += __atomic_load_n(&log->rings[i].dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+/* Writes the records still buffered, stops the writer and closes the file. Call once the workers stopped. */
+void access_log_close(access_log *log)
+{
+    if (log == NULL)
+    {
+        return;
+    }
+    __atomic_store_n(&log->running, 0, __ATOMIC_RELEASE);
+    pthread_join(log->thread, NULL);
+    close(log->fd);
+    free(log->rings);
+    free(log);
+}
+
+/* Stores the address of addr in the 16 bytes of address, IPv4 mapped to IPv6. */
+void access_log_address(const struct sockaddr *addr, uint8_t *address)
+{
+    memset(address, 0, 16);
+    if (addr->sa_family == AF_INET6)
+    {
+        memcpy(address, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    }
+    else if (addr->sa_family == AF_INET)
+    {
+        address[10] = 0xff;
+        address[11] = 0xff;
+        memcpy(address + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+}
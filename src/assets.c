@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "assets.h"
+#include "hash.h"
+
+#define ASSET_MAX_DEPTH 32
+#define ASSET_PATH_SIZE 4096
+
+typedef struct asset_entry
+{
+    char fingerprint[ASSET_FINGERPRINT_LEN + 1];
+} asset_entry;
+
+/*
+ * Formats the fingerprint of content hashing to hash: the leading digits of
+ * the hash as cache_node etags print it, so the two can be compared.
+ */
+void asset_format_fingerprint(uint64_t hash, char *fingerprint)
+{
+    char digits[17];
+    snprintf(digits, sizeof(digits), "%016llx", (unsigned long long)hash);
+    memcpy(fingerprint, digits, ASSET_FINGERPRINT_LEN);
+    fingerprint[ASSET_FINGERPRINT_LEN] = '\0';
+}
+
+/* Hashes the content of the open file fd into fingerprint. Returns 0, or -1 on error. */
+int asset_hash_fd(int fd, char *fingerprint)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        return -1;
+    }
+
+    uint64_t hash;
+    if (st.st_size == 0)
+    {
+        hash = hash64("", 0, 0);
+    }
+    else
+    {
+        void *content = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (content == MAP_FAILED)
+        {
+            return -1;
+        }
+        hash = hash64(content, st.st_size, 0);
+        munmap(content, st.st_size);
+    }
+    asset_format_fingerprint(hash, fingerprint);
+    return 0;
+}
+
+/* Hashes the content of the regular file at path into fingerprint. Returns 0, or -1 on error. */
+int asset_hash_file(const char *path, char *fingerprint)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int rv = asset_hash_fd(fd, fingerprint);
+    close(fd);
+    return rv;
+}
+
+/*
+ * Adds every regular file below the directory in path to the map.
+ * path is a buffer of ASSET_PATH_SIZE holding len bytes; root_len of them are the root directory.
+ */
+void asset_map_scan(asset_map *map, char *path, size_t len, size_t root_len, int depth)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Could not open %s to fingerprint its files.\n", path);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        size_t name_len = strlen(entry->d_name);
+        if (len + 1 + name_len >= ASSET_PATH_SIZE)
+        {
+            continue;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, entry->d_name, name_len + 1);
+
+        struct stat st;
+        if (stat(path, &st) < 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            // symbolic links may point back up the tree
+            if (depth < ASSET_MAX_DEPTH)
+            {
+                asset_map_scan(map, path, len + 1 + name_len, root_len, depth + 1);
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        asset_entry *asset = (asset_entry *)malloc(sizeof(asset_entry));
+        if (asset == NULL)
+        {
+            fprintf(stderr, "Error allocating memory to asset_entry.\n");
+            continue;
+        }
+        if (asset_hash_file(path, asset->fingerprint) < 0)
+        {
+            fprintf(stderr, "Could not fingerprint %s.\n", path);
+            free(asset);
+            continue;
+        }
+        hashtable_put(map->table, path + root_len + 1, asset);
+        map->num_assets++;
+    }
+    path[len] = '\0';
+    closedir(dir);
+}
+
+/*
+ * Fingerprints every file below root_dir by hashing its content.
+ * Reads all of them, so it belongs to startup rather than the request path.
+ */
+asset_map *asset_map_create(const char *root_dir)
+{
+    char path[ASSET_PATH_SIZE];
+    size_t root_len = strlen(root_dir);
+    while (root_len > 1 && root_dir[root_len - 1] == '/')
+    {
+        root_len--;
+    }
+    if (root_len >= sizeof(path))
+    {
+        fprintf(stderr, "Asset root directory path is too long.\n");
+        return NULL;
+    }
+
+    asset_map *map = (asset_map *)malloc(sizeof(asset_map));
+    if (map == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to asset_map.\n");
+        return NULL;
+    }
+    map->table = hashtable_create(1024, NULL);
+    if (map->table == NULL)
+    {
+        fprintf(stderr, "Error creating hashtable for asset_map.\n");
+        free(map);
+        return NULL;
+    }
+    map->num_assets = 0;
+
+    memcpy(path, root_dir, root_len);
+    path[root_len] = '\0';
+    asset_map_scan(map, path, root_len, root_len, 0);
+    return map;
+}
+
+/* Returns the fingerprint of file, a path relative to the root directory, or NULL if unknown. */
+const char *asset_fingerprint(asset_map *map, const char *file)
+{
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    asset_entry *asset = hashtable_get(map->table, (char *)file);
+    return asset ? asset->fingerprint : NULL;
+}
+
+/*
+ * Writes name with fingerprint inserted before the extension of its last
+ * segment, e.g. "css/main.css" becomes "css/main.<fingerprint>.css".
+ * Names without an extension get the fingerprint appended.
+ * Returns the length written, 0 if it does not fit in buffer.
+ */
+size_t asset_fingerprint_name(const char *name, const char *fingerprint, char *buffer, size_t size)
+{
+    const char *segment = strrchr(name, '/');
+    segment = segment ? segment + 1 : name;
+    const char *extension = strrchr(segment, '.');
+    if (extension == NULL || extension == segment)
+    {
+        extension = segment + strlen(segment);
+    }
+
+    int length = snprintf(buffer, size, "%.*s.%s%s", (int)(extension - name), name, fingerprint, extension);
+    return length > 0 && length < (int)size ? (size_t)length : 0;
+}
+
+static int is_fingerprint(const char *str)
+{
+    for (int i = 0; i < ASSET_FINGERPRINT_LEN; i++)
+    {
+        if (!isxdigit((unsigned char)str[i]) || isupper((unsigned char)str[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Removes the fingerprint from file, a terminated path of len bytes relative
+ * to the root directory, if it is the current fingerprint of the file it names.
+ * Returns the new length, or -1 with file unchanged if it is not fingerprinted.
+ */
+long asset_strip_fingerprint(asset_map *map, char *file, size_t len)
+{
+    if (map == NULL)
+    {
+        return -1;
+    }
+    char *segment = strrchr(file, '/');
+    segment = segment ? segment + 1 : file;
+    char *end = file + len;
+    char *extension = strrchr(segment, '.');
+    if (extension == NULL)
+    {
+        return -1;
+    }
+
+    // "name.<fingerprint>.ext" or, for names without an extension, "name.<fingerprint>"
+    char *dot = NULL;
+    if (extension - segment > ASSET_FINGERPRINT_LEN + 1 && extension[-ASSET_FINGERPRINT_LEN - 1] == '.' && is_fingerprint(extension - ASSET_FINGERPRINT_LEN))
+    {
+        dot = extension - ASSET_FINGERPRINT_LEN - 1;
+    }
+    else if (end - extension == ASSET_FINGERPRINT_LEN + 1 && extension > segment && is_fingerprint(extension + 1))
+    {
+        dot = extension;
+    }
+    if (dot == NULL)
+    {
+        return -1;
+    }
+
+    char fingerprint[ASSET_FINGERPRINT_LEN + 1];
+    memcpy(fingerprint, dot + 1, ASSET_FINGERPRINT_LEN);
+    fingerprint[ASSET_FINGERPRINT_LEN] = '\0';
+    char *tail = dot + 1 + ASSET_FINGERPRINT_LEN;
+    memmove(dot, tail, end - tail + 1);
+
+    const char *current = asset_fingerprint(map, file);
+    if (current == NULL || strcmp(current, fingerprint) != 0)
+    {
+        // a stale fingerprint or a file that merely looks fingerprinted
+        memmove(tail, dot, end - tail + 1);
+        dot[0] = '.';
+        memcpy(dot + 1, fingerprint, ASSET_FINGERPRINT_LEN);
+        return -1;
+    }
+    return len - ASSET_FINGERPRINT_LEN - 1;
+}
+
+static void asset_entry_free(void *data, void *arg)
+{
+    (void)arg;
+    free(data);
+}
+
+void asset_map_destroy(asset_map *map)
+{
+    if (map == NULL)
+    {
+        return;
+    }
+    hashtable_foreach(map->table, asset_entry_free, NULL);
+    hashtable_destroy(map->table);
+    free(map);
+}
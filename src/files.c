@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include "files.h"
 #include "utils.h"
+#include "log.h"
 #include <math.h>
 // #define STB_IMAGE_IMPLEMENTATION
 // #include "stb_image.h"
@@ -18,14 +19,14 @@ file_data *file_load(char *filename)
     // obtain the file size of the filename passed
     if (stat(filename, &buf) == -1)
     {
-        printf("cannot load file size!\n");
+        log_debug("Cannot load the size of %s.\n", filename);
         return NULL;
     }
 
     // check if the file is a regular file
     if (!(buf.st_mode & S_IFREG))
     {
-        printf("not a regular file!\n");
+        log_debug("%s is not a regular file.\n", filename);
         return NULL;
     }
 
@@ -33,7 +34,7 @@ file_data *file_load(char *filename)
     FILE *fp = fopen(filename, "rb");
     if (fp == NULL)
     {
-        printf("cannot open file!\n");
+        log_debug("Cannot open %s.\n", filename);
         return NULL;
     }
 
@@ -78,6 +79,7 @@ file_data *file_load(char *filename)
     filedata->data = buffer;
     filedata->size = size;
     filedata->filename = filename;
+    filedata->mtime = buf.st_mtime;
     return filedata;
 }
 
@@ -115,6 +117,7 @@ file_data *read_file_fd(char *filename)
     filedata->data = fd;
     filedata->filename = filename;
     filedata->size = size;
+    filedata->mtime = 0;
 
     // printf("File(name=%s, file_descriptor=%d)\n", filename, fd);
 
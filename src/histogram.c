@@ -0,0 +1,113 @@
+#include <string.h>
+#include "histogram.h"
+
+static int histogram_bucket(uint64_t value)
+{
+    if (value >= (1UL << HISTOGRAM_MAX_BITS))
+    {
+        value = (1UL << HISTOGRAM_MAX_BITS) - 1;
+    }
+    if (value < HISTOGRAM_SUB_BUCKETS)
+    {
+        return (int)value;
+    }
+    // keep the top HISTOGRAM_SUB_BUCKET_BITS bits. The highest one is always set
+    int shift = 64 - __builtin_clzl(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    return HISTOGRAM_SUB_BUCKETS + (shift - 1) * (HISTOGRAM_SUB_BUCKETS / 2) + (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS / 2;
+}
+
+/* Returns the largest value recorded into bucket. */
+uint64_t histogram_bucket_limit(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    int shift = (bucket - HISTOGRAM_SUB_BUCKETS) / (HISTOGRAM_SUB_BUCKETS / 2) + 1;
+    uint64_t top = (bucket - HISTOGRAM_SUB_BUCKETS) % (HISTOGRAM_SUB_BUCKETS / 2) + HISTOGRAM_SUB_BUCKETS / 2;
+    return ((top + 1) << shift) - 1;
+}
+
+/*
+ * Records value. Only the owner of hist may call this. The stores are
+ * atomic but not read-modify-write, so recording takes no locked instruction.
+ */
+void histogram_record(histogram *hist, uint64_t value)
+{
+    uint64_t *bucket = &hist->buckets[histogram_bucket(value)];
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+    if (value > hist->max)
+    {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+/* Same as histogram_record(), for a histogram written by several threads. */
+void histogram_add(histogram *hist, uint64_t value)
+{
+    __atomic_fetch_add(&hist->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&hist->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Adds the values of from to into. from may be written meanwhile; into
+ * then holds a snapshot that is off by the records in flight at most.
+ */
+void histogram_merge(histogram *into, const histogram *from)
+{
+    // the count is read first, so the buckets hold at least as many values
+    uint64_t count = __atomic_load_n(&from->count, __ATOMIC_ACQUIRE);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    into->max = max > into->max ? max : into->max;
+    uint64_t counted = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        uint64_t n = __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+        into->buckets[i] += n;
+        counted += n;
+    }
+    into->count += counted > count ? counted : count;
+}
+
+/*
+ * Returns the value below which percentile percent of the values fall,
+ * e.g. 99.9. The maximum is exact, the other values are bucket limits.
+ */
+uint64_t histogram_percentile(const histogram *hist, double percentile)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        total += hist->buckets[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < hist->max ? limit : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+double histogram_mean(const histogram *hist)
+{
+    return hist->count ? (double)hist->sum / hist->count : 0;
+}
@@ -0,0 +1,788 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include "http.h"
+
+static const char *method_names[HTTP_METHOD_COUNT] = {
+    "UNKNOWN",
+    "GET",
+    "HEAD",
+    "POST",
+    "PUT",
+    "DELETE",
+    "CONNECT",
+    "OPTIONS",
+    "TRACE",
+    "PATCH",
+};
+
+/*
+ * Maps the method token of a request line to http_method.
+ * The token is not required to be NUL terminated.
+ */
+http_method http_method_parse(const char *method, size_t method_len)
+{
+    if (method == NULL)
+    {
+        return HTTP_METHOD_UNKNOWN;
+    }
+
+    switch (method_len)
+    {
+    case 3:
+        if (memcmp(method, "GET", 3) == 0)
+            return HTTP_METHOD_GET;
+        if (memcmp(method, "PUT", 3) == 0)
+            return HTTP_METHOD_PUT;
+        break;
+    case 4:
+        if (memcmp(method, "HEAD", 4) == 0)
+            return HTTP_METHOD_HEAD;
+        if (memcmp(method, "POST", 4) == 0)
+            return HTTP_METHOD_POST;
+        break;
+    case 5:
+        if (memcmp(method, "TRACE", 5) == 0)
+            return HTTP_METHOD_TRACE;
+        if (memcmp(method, "PATCH", 5) == 0)
+            return HTTP_METHOD_PATCH;
+        break;
+    case 6:
+        if (memcmp(method, "DELETE", 6) == 0)
+            return HTTP_METHOD_DELETE;
+        break;
+    case 7:
+        if (memcmp(method, "CONNECT", 7) == 0)
+            return HTTP_METHOD_CONNECT;
+        if (memcmp(method, "OPTIONS", 7) == 0)
+            return HTTP_METHOD_OPTIONS;
+        break;
+    }
+    return HTTP_METHOD_UNKNOWN;
+}
+
+const char *http_method_name(http_method method)
+{
+    if (method <= HTTP_METHOD_UNKNOWN || method >= HTTP_METHOD_COUNT)
+    {
+        return method_names[HTTP_METHOD_UNKNOWN];
+    }
+    return method_names[method];
+}
+
+/*
+ * Records the position of the commonly used headers, so handlers can fetch
+ * them without scanning the header array.
+ */
+void http_request_index_headers(http_request *request)
+{
+    memset(request->indexed, 0, sizeof(request->indexed));
+    for (size_t i = 0; i < request->num_headers; i++)
+    {
+        const struct phr_header *header = &request->headers[i];
+        const char *name = header->name;
+        int id = -1;
+
+        if (name == NULL)
+        {
+            continue; // continuation of a multiline header
+        }
+
+        switch (header->name_len)
+        {
+        case 4:
+            if (strncasecmp(name, "Host", 4) == 0)
+                id = HTTP_HEADER_HOST;
+            break;
+        case 5:
+            if (strncasecmp(name, "Range", 5) == 0)
+                id = HTTP_HEADER_RANGE;
+            break;
+        case 6:
+            if (strncasecmp(name, "Accept", 6) == 0)
+                id = HTTP_HEADER_ACCEPT;
+            else if (strncasecmp(name, "Cookie", 6) == 0)
+                id = HTTP_HEADER_COOKIE;
+            break;
+        case 8:
+            if (strncasecmp(name, "If-Range", 8) == 0)
+                id = HTTP_HEADER_IF_RANGE;
+            break;
+        case 10:
+            if (strncasecmp(name, "User-Agent", 10) == 0)
+                id = HTTP_HEADER_USER_AGENT;
+            else if (strncasecmp(name, "Connection", 10) == 0)
+                id = HTTP_HEADER_CONNECTION;
+            break;
+        case 12:
+            if (strncasecmp(name, "Content-Type", 12) == 0)
+                id = HTTP_HEADER_CONTENT_TYPE;
+            break;
+        case 13:
+            if (strncasecmp(name, "If-None-Match", 13) == 0)
+                id = HTTP_HEADER_IF_NONE_MATCH;
+            break;
+        case 14:
+            if (strncasecmp(name, "Content-Length", 14) == 0)
+                id = HTTP_HEADER_CONTENT_LENGTH;
+            break;
+        case 15:
+            if (strncasecmp(name, "Accept-Encoding", 15) == 0)
+                id = HTTP_HEADER_ACCEPT_ENCODING;
+            break;
+        case 17:
+            if (strncasecmp(name, "If-Modified-Since", 17) == 0)
+                id = HTTP_HEADER_IF_MODIFIED_SINCE;
+            break;
+        }
+
+        // the first occurence of a header wins
+        if (id >= 0 && request->indexed[id] == NULL)
+        {
+            request->indexed[id] = header;
+        }
+    }
+}
+
+/*
+ * Returns the first header with the given name (case insensitive) or NULL.
+ */
+const struct phr_header *http_request_header(http_request *request, const char *name)
+{
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < request->num_headers; i++)
+    {
+        const struct phr_header *header = &request->headers[i];
+        if (header->name_len == name_len && strncasecmp(header->name, name, name_len) == 0)
+        {
+            return header;
+        }
+    }
+    return NULL;
+}
+
+const struct phr_header *http_request_header_id(http_request *request, http_header_id id)
+{
+    if (id < 0 || id >= HTTP_HEADER_COUNT)
+    {
+        return NULL;
+    }
+    return request->indexed[id];
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Decodes a form encoded component ('+' and %XX escapes) into out.
+ * Returns the decoded length. Malformed escapes are copied as they are.
+ */
+static size_t form_decode(const char *in, size_t len, char *out)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (in[i] == '+')
+        {
+            out[n++] = ' ';
+        }
+        else if (in[i] == '%' && i + 2 < len && hex_value(in[i + 1]) >= 0 && hex_value(in[i + 2]) >= 0)
+        {
+            out[n++] = (char)(hex_value(in[i + 1]) * 16 + hex_value(in[i + 2]));
+            i += 2;
+        }
+        else
+        {
+            out[n++] = in[i];
+        }
+    }
+    return n;
+}
+
+static int decode_params(http_request *request)
+{
+    request->params_decoded = 1;
+    request->num_params = 0;
+    if (request->query == NULL || request->query_len == 0)
+    {
+        return 0;
+    }
+
+    int max_params = 1;
+    for (size_t i = 0; i < request->query_len; i++)
+    {
+        if (request->query[i] == '&')
+            max_params++;
+    }
+
+    if (request->arena)
+    {
+        request->params = (http_param *)arena_alloc(request->arena, sizeof(http_param) * max_params);
+        request->params_buffer = (char *)arena_alloc(request->arena, request->query_len);
+    }
+    else
+    {
+        request->params = (http_param *)malloc(sizeof(http_param) * max_params);
+        request->params_buffer = (char *)malloc(request->query_len);
+    }
+    if (request->params == NULL || request->params_buffer == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to query parameters.\n");
+        http_request_cleanup(request);
+        request->params_decoded = 1;
+        return -1;
+    }
+
+    const char *p = request->query, *end = request->query + request->query_len;
+    char *out = request->params_buffer;
+    while (p < end)
+    {
+        const char *amp = memchr(p, '&', end - p);
+        const char *field_end = amp ? amp : end;
+        const char *eq = memchr(p, '=', field_end - p);
+        const char *name_end = eq ? eq : field_end;
+
+        if (name_end > p)
+        {
+            http_param *param = &request->params[request->num_params++];
+            param->name = out;
+            param->name_len = form_decode(p, name_end - p, out);
+            out += param->name_len;
+            param->value = out;
+            param->value_len = eq ? form_decode(eq + 1, field_end - eq - 1, out) : 0;
+            out += param->value_len;
+        }
+        p = field_end + 1;
+    }
+    return request->num_params;
+}
+
+/*
+ * Returns the decoded value of the first query parameter called name, or NULL.
+ * The query string is decoded on the first call for the request.
+ */
+const char *http_request_param(http_request *request, const char *name, size_t *value_len)
+{
+    if (!request->params_decoded)
+    {
+        decode_params(request);
+    }
+
+    size_t name_len = strlen(name);
+    for (int i = 0; i < request->num_params; i++)
+    {
+        http_param *param = &request->params[i];
+        if (param->name_len == name_len && memcmp(param->name, name, name_len) == 0)
+        {
+            if (value_len)
+                *value_len = param->value_len;
+            return param->value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Points params to the decoded query parameters and returns their count.
+ */
+int http_request_params(http_request *request, const http_param **params)
+{
+    if (!request->params_decoded)
+    {
+        decode_params(request);
+    }
+    *params = request->params;
+    return request->num_params;
+}
+
+void http_request_cleanup(http_request *request)
+{
+    // arena memory is released when the arena is reset
+    if (request->params && !request->arena)
+        free(request->params);
+    if (request->params_buffer && !request->arena)
+        free(request->params_buffer);
+    request->params = NULL;
+    request->params_buffer = NULL;
+    request->num_params = 0;
+    request->params_decoded = 0;
+}
+
+/*
+ * Rewrites path in place into its canonical form, in a single pass:
+ * percent escapes are decoded, empty and "." segments are dropped and ".."
+ * removes the segment before it. The result is NUL terminated and never
+ * longer than the input, so equivalent paths become the same route and
+ * cache key. Returns the new length, or -1 if the path does not start with
+ * '/', has a malformed escape, decodes to a NUL byte or climbs above the root.
+ */
+long http_path_normalize(char *path, size_t path_len)
+{
+    if (path_len == 0 || path[0] != '/')
+        return -1;
+
+    const char *in = path + 1, *end = path + path_len;
+    char *out = path + 1;
+    int separator = 1;
+    while (separator)
+    {
+        // copy one segment, decoding as we go. in ends up past the slash that closes it
+        char *segment = out;
+        separator = 0;
+        while (in < end)
+        {
+            char c = *in++;
+            if (c == '/')
+            {
+                separator = 1;
+                break;
+            }
+            if (c == '%')
+            {
+                if (end - in < 2 || hex_value(in[0]) < 0 || hex_value(in[1]) < 0)
+                    return -1;
+                c = (char)(hex_value(in[0]) * 16 + hex_value(in[1]));
+                in += 2;
+                if (c == '\0')
+                    return -1;
+                if (c == '/')
+                {
+                    // an encoded slash separates segments like a plain one
+                    separator = 1;
+                    break;
+                }
+            }
+            *out++ = c;
+        }
+
+        size_t segment_len = out - segment;
+        if (segment_len == 1 && segment[0] == '.')
+        {
+            out = segment;
+        }
+        else if (segment_len == 2 && segment[0] == '.' && segment[1] == '.')
+        {
+            if (segment == path + 1)
+                return -1;
+            // drop the parent segment along with its trailing slash
+            out = segment - 1;
+            while (out[-1] != '/')
+                out--;
+        }
+        else if (segment_len > 0 && separator)
+        {
+            *out++ = '/';
+        }
+    }
+    *out = '\0';
+    return out - path;
+}
+
+static const char *day_names[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *month_names[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+/*
+ * Writes t as an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT") into buffer,
+ * which must hold HTTP_DATE_SIZE bytes. Independent of the locale.
+ */
+size_t http_format_date(time_t t, char *buffer)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return snprintf(
+        buffer, HTTP_DATE_SIZE, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+        day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/*
+ * Returns the current time as an HTTP date, for the Date header. Each thread
+ * keeps its own copy and formats it again only when the second changes.
+ */
+const char *http_date_now(void)
+{
+    static __thread time_t formatted_at = 0;
+    static __thread char date[HTTP_DATE_SIZE];
+    time_t now = time(NULL);
+    if (now != formatted_at)
+    {
+        http_format_date(now, date);
+        formatted_at = now;
+    }
+    return date;
+}
+
+static int parse_digits(const char *s, int n)
+{
+    int value = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (s[i] < '0' || s[i] > '9')
+            return -1;
+        value = value * 10 + (s[i] - '0');
+    }
+    return value;
+}
+
+/*
+ * Parses an HTTP date in the preferred format of RFC 7231. The obsolete
+ * formats are not accepted. Returns -1 if date is not a valid HTTP date.
+ */
+time_t http_parse_date(const char *date, size_t len)
+{
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (len != 29 || date[3] != ',' || date[4] != ' ' || date[7] != ' ' || date[11] != ' ' || date[16] != ' ' ||
+        date[19] != ':' || date[22] != ':' || memcmp(date + 25, " GMT", 4) != 0)
+        return -1;
+
+    int month = -1;
+    for (int i = 0; i < 12; i++)
+    {
+        if (memcmp(date + 8, month_names[i], 3) == 0)
+        {
+            month = i;
+            break;
+        }
+    }
+    int day = parse_digits(date + 5, 2), year = parse_digits(date + 12, 4);
+    int hour = parse_digits(date + 17, 2), minute = parse_digits(date + 20, 2), second = parse_digits(date + 23, 2);
+    if (month < 0 || day < 1 || day > 31 || year < 1970 || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+        return -1;
+
+    // days since the epoch of the civil date, valid for the proleptic Gregorian calendar
+    int y = month < 2 ? year - 1 : year;
+    int era = y / 400;
+    int year_of_era = y - era * 400;
+    int day_of_year = (153 * (month < 2 ? month + 10 : month - 2) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    long days = (long)era * 146097 + day_of_era - 719468;
+    return (time_t)(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+// compares one entity tag of an If-None-Match list with etag, ignoring a weak prefix
+static int etag_matches(const char *tag, size_t tag_len, const char *etag)
+{
+    if (tag_len == 1 && tag[0] == '*')
+        return 1;
+    if (tag_len > 2 && tag[0] == 'W' && tag[1] == '/')
+    {
+        tag += 2;
+        tag_len -= 2;
+    }
+    return tag_len == strlen(etag) && memcmp(tag, etag, tag_len) == 0;
+}
+
+/*
+ * Returns 1 if the client already holds the representation identified by
+ * etag and last_modified, so a 304 can be sent instead of the body.
+ * If-None-Match takes precedence over If-Modified-Since, as in RFC 7232.
+ * Only GET and HEAD requests are ever answered with 304.
+ */
+int http_request_not_modified(http_request *request, const char *etag, const char *last_modified, time_t mtime)
+{
+    if (request == NULL || (request->method != HTTP_METHOD_GET && request->method != HTTP_METHOD_HEAD))
+        return 0;
+
+    const struct phr_header *if_none_match = http_request_header_id(request, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_none_match != NULL)
+    {
+        if (etag == NULL)
+            return 0;
+        const char *p = if_none_match->value, *end = p + if_none_match->value_len;
+        while (p < end)
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+                p++;
+            const char *tag = p;
+            while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+                p++;
+            if (p > tag && etag_matches(tag, p - tag, etag))
+                return 1;
+        }
+        return 0;
+    }
+
+    const struct phr_header *if_modified_since = http_request_header_id(request, HTTP_HEADER_IF_MODIFIED_SINCE);
+    if (if_modified_since == NULL || last_modified == NULL)
+        return 0;
+    // browsers echo the Last-Modified value they were sent, which avoids parsing the date
+    if (if_modified_since->value_len == strlen(last_modified) && memcmp(if_modified_since->value, last_modified, if_modified_since->value_len) == 0)
+        return 1;
+    time_t since = http_parse_date(if_modified_since->value, if_modified_since->value_len);
+    return since != (time_t)-1 && mtime <= since;
+}
+
+/*
+ * Parses the value of a Range header for a representation of size bytes into
+ * at most max_ranges ranges, with the end of each range clamped to the last
+ * byte. Returns the number of satisfiable ranges, 0 if none of them can be
+ * satisfied (416), or -1 if the header is malformed, uses another unit or
+ * asks for more than max_ranges ranges, in which case it is ignored.
+ */
+int http_parse_range(const char *value, size_t len, size_t size, http_range *ranges, int max_ranges)
+{
+    const char *p = value, *end = value + len;
+    if (len < 6 || memcmp(p, "bytes=", 6) != 0)
+        return -1;
+    p += 6;
+
+    int num_ranges = 0, num_specs = 0;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end && *p == ',')
+        {
+            p++;
+            continue;
+        }
+        if (p == end)
+            break;
+
+        // first-byte-pos "-" [ last-byte-pos ], or "-" suffix-length
+        int has_first = 0, has_last = 0;
+        size_t first = 0, last = 0;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            if (first > (SIZE_MAX - 9) / 10)
+                return -1;
+            first = first * 10 + (*p++ - '0');
+            has_first = 1;
+        }
+        if (p == end || *p != '-')
+            return -1;
+        p++;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            if (last > (SIZE_MAX - 9) / 10)
+                return -1;
+            last = last * 10 + (*p++ - '0');
+            has_last = 1;
+        }
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if ((p < end && *p != ',') || (!has_first && !has_last) || (has_first && has_last && last < first))
+            return -1;
+        if (++num_specs > max_ranges)
+            return -1;
+
+        http_range range;
+        if (!has_first)
+        {
+            // the last bytes of the representation
+            if (last == 0 || size == 0)
+                continue;
+            range.start = last < size ? size - last : 0;
+            range.end = size - 1;
+        }
+        else
+        {
+            if (first >= size)
+                continue;
+            range.start = first;
+            range.end = has_last && last < size ? last : size - 1;
+        }
+        ranges[num_ranges++] = range;
+    }
+    return num_specs > 0 ? num_ranges : -1;
+}
+
+/*
+ * Returns 1 if the Range header of request should be honoured, which is when
+ * there is no If-Range or it names the current etag or last_modified date.
+ * Both are compared exactly; a weak entity tag never matches.
+ */
+int http_request_range_applies(http_request *request, const char *etag, const char *last_modified)
+{
+    const struct phr_header *if_range = http_request_header_id(request, HTTP_HEADER_IF_RANGE);
+    if (if_range == NULL)
+        return 1;
+    const char *validator = if_range->value_len > 0 && if_range->value[0] == '"' ? etag : last_modified;
+    return validator != NULL && if_range->value_len == strlen(validator) && memcmp(if_range->value, validator, if_range->value_len) == 0;
+}
+
+// content codings with precompressed sidecar files, in order of preference
+static const struct
+{
+    int encoding;
+    const char *name;
+    size_t name_len;
+    const char *extension;
+} encoding_names[] = {
+    {HTTP_ENCODING_BR, "br", 2, ".br"},
+    {HTTP_ENCODING_GZIP, "gzip", 4, ".gz"},
+};
+
+#define NUM_ENCODINGS (int)(sizeof(encoding_names) / sizeof(encoding_names[0]))
+
+/*
+ * Returns the HTTP_ENCODING_* bits of the codings the Accept-Encoding header
+ * of request allows. A coding with q=0 is refused, even if "*" is present.
+ */
+int http_request_accepted_encodings(http_request *request)
+{
+    const struct phr_header *accept_encoding = http_request_header_id(request, HTTP_HEADER_ACCEPT_ENCODING);
+    if (accept_encoding == NULL)
+        return 0;
+
+    int accepted = 0, refused = 0, any = 0;
+    const char *p = accept_encoding->value, *end = p + accept_encoding->value_len;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *coding = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t coding_len = p - coding;
+
+        // parameters up to the next coding. A qvalue is zero when it has no digit other than 0
+        int zero = 0;
+        while (p < end && *p != ',')
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ';'))
+                p++;
+            if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+            {
+                zero = 1;
+                for (p += 2; p < end && *p != ',' && *p != ';' && *p != ' '; p++)
+                    if (*p != '0' && *p != '.')
+                        zero = 0;
+            }
+            else
+            {
+                while (p < end && *p != ',' && *p != ';')
+                    p++;
+            }
+        }
+
+        if (coding_len == 1 && coding[0] == '*')
+        {
+            any = !zero;
+            continue;
+        }
+        for (int i = 0; i < NUM_ENCODINGS; i++)
+        {
+            if (coding_len == encoding_names[i].name_len && strncasecmp(coding, encoding_names[i].name, coding_len) == 0)
+            {
+                if (zero)
+                    refused |= encoding_names[i].encoding;
+                else
+                    accepted |= encoding_names[i].encoding;
+            }
+        }
+    }
+    if (any)
+        accepted |= HTTP_ENCODING_ALL & ~refused;
+    return accepted & ~refused;
+}
+
+/*
+ * Returns the preferred coding out of the HTTP_ENCODING_* bits in encodings,
+ * or 0 if there is none.
+ */
+int http_encoding_preferred(int encodings)
+{
+    for (int i = 0; i < NUM_ENCODINGS; i++)
+        if (encodings & encoding_names[i].encoding)
+            return encoding_names[i].encoding;
+    return 0;
+}
+
+// returns the Content-Encoding name of the coding, or NULL
+const char *http_encoding_name(int encoding)
+{
+    for (int i = 0; i < NUM_ENCODINGS; i++)
+        if (encoding == encoding_names[i].encoding)
+            return encoding_names[i].name;
+    return NULL;
+}
+
+// returns the extension of the precompressed sidecar files of the coding, e.g. ".gz", or NULL
+const char *http_encoding_extension(int encoding)
+{
+    for (int i = 0; i < NUM_ENCODINGS; i++)
+        if (encoding == encoding_names[i].encoding)
+            return encoding_names[i].extension;
+    return NULL;
+}
+
+#define CALIBRATION_ROUNDS 5
+#define CALIBRATION_ITERATIONS 2000
+
+// a typical browser request, used to time the parser scanners
+static const char calibration_request[] =
+    "GET /assets/css/main.css?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "If-None-Match: \"5f2c-1a9e3b7c\"\r\n"
+    "\r\n";
+
+static long calibration_time(void)
+{
+    const char *method, *path;
+    size_t method_len, path_len, num_headers;
+    int minor_version;
+    struct phr_header headers[HTTP_MAX_HEADERS];
+    struct timespec start, end;
+    long best = -1;
+
+    for (int round = 0; round < CALIBRATION_ROUNDS; round++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < CALIBRATION_ITERATIONS; i++)
+        {
+            num_headers = HTTP_MAX_HEADERS;
+            phr_parse_request(calibration_request, sizeof(calibration_request) - 1, &method, &method_len, &path, &path_len,
+                              &minor_version, headers, &num_headers, 0);
+            __asm__ __volatile__("" : : "r"(headers) : "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long elapsed = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/*
+ * Times every scanner the CPU supports on a typical request and makes the
+ * parser use the fastest one. The widest scanner is not always the fastest,
+ * since most header values are shorter than a 32 byte vector.
+ * Must be called before any thread starts parsing. Returns the selected scanner.
+ */
+int http_parser_calibrate(void)
+{
+    int fastest = phr_simd_current();
+    long fastest_time = -1;
+
+    for (int simd = 0; simd < PHR_SIMD_COUNT; simd++)
+    {
+        if (phr_simd_select(simd) < 0)
+            continue;
+        long elapsed = calibration_time();
+        if (fastest_time < 0 || elapsed < fastest_time)
+        {
+            fastest = simd;
+            fastest_time = elapsed;
+        }
+    }
+    phr_simd_select(fastest);
+    return fastest;
+}
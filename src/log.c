@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+
+int log_level = LOG_LEVEL_INFO;
+
+static const char *log_level_names[] = {"", "ERROR", "WARN", "INFO", "DEBUG"};
+
+/*
+ * Messages on their way to stderr. Writers only copy into buffer, the
+ * thread started by log_start() does the write() calls.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t thread;
+    int users;   // log_start() calls not matched by log_stop() yet
+    int running; // the thread takes the messages
+    long dropped; // messages lost while buffer was full
+    size_t head; // next byte written into buffer
+    size_t tail; // next byte the thread writes out
+    char buffer[LOG_BUFFER_SIZE];
+} log_sink = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0, 0, {0}};
+
+/* Sets the most detailed level written, LOG_LEVEL_OFF for none. Levels above LOG_COMPILE_LEVEL stay off. */
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+static void write_stderr(const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t rv = write(STDERR_FILENO, data, size);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += rv;
+        size -= rv;
+    }
+}
+
+// copies message into the ring, or counts it if it does not fit. Call with log_sink.lock held
+static void log_sink_push(const char *message, size_t length)
+{
+    size_t used = log_sink.head - log_sink.tail;
+    if (length > LOG_BUFFER_SIZE - used)
+    {
+        log_sink.dropped++;
+        return;
+    }
+    size_t offset = log_sink.head % LOG_BUFFER_SIZE;
+    size_t first = length < LOG_BUFFER_SIZE - offset ? length : LOG_BUFFER_SIZE - offset;
+    memcpy(log_sink.buffer + offset, message, first);
+    memcpy(log_sink.buffer, message + first, length - first);
+    if (used == 0)
+    {
+        pthread_cond_signal(&log_sink.ready);
+    }
+    log_sink.head += length;
+}
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    static char batch[LOG_BUFFER_SIZE];
+    pthread_mutex_lock(&log_sink.lock);
+    for (;;)
+    {
+        while (log_sink.running && log_sink.head == log_sink.tail && log_sink.dropped == 0)
+        {
+            pthread_cond_wait(&log_sink.ready, &log_sink.lock);
+        }
+        size_t length = log_sink.head - log_sink.tail;
+        size_t offset = log_sink.tail % LOG_BUFFER_SIZE;
+        size_t first = length < LOG_BUFFER_SIZE - offset ? length : LOG_BUFFER_SIZE - offset;
+        memcpy(batch, log_sink.buffer + offset, first);
+        memcpy(batch + first, log_sink.buffer, length - first);
+        log_sink.tail = log_sink.head;
+        long dropped = log_sink.dropped;
+        log_sink.dropped = 0;
+        int running = log_sink.running;
+        pthread_mutex_unlock(&log_sink.lock);
+
+        write_stderr(batch, length);
+        if (dropped > 0)
+        {
+            char note[64];
+            write_stderr(note, snprintf(note, sizeof(note), "[WARN] %ld log messages dropped.\n", dropped));
+        }
+        if (!running)
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&log_sink.lock);
+    }
+}
+
+/*
+ * Writes a message of a log statement unless the statement already wrote
+ * LOG_RATE_LIMIT messages this second. The first message written after some
+ * were held back reports how many. Use the log_error() ... log_debug() macros.
+ */
+void log_write(log_site *site, int level, const char *format, ...)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    long window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+    if (window != now.tv_sec && __atomic_compare_exchange_n(&site->window, &window, now.tv_sec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_RATE_LIMIT)
+    {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char message[LOG_MESSAGE_SIZE];
+    int length = 0;
+    int suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed > 0)
+    {
+        length = snprintf(message, sizeof(message), "[%s] %d similar messages suppressed.\n", log_level_names[level], suppressed);
+    }
+    length += snprintf(message + length, sizeof(message) - length, "[%s] ", log_level_names[level]);
+    va_list args;
+    va_start(args, format);
+    length += vsnprintf(message + length, sizeof(message) - length, format, args);
+    va_end(args);
+    if (length >= (int)sizeof(message))
+    {
+        length = sizeof(message) - 1;
+        message[length - 1] = '\n';
+    }
+
+    pthread_mutex_lock(&log_sink.lock);
+    if (log_sink.running)
+    {
+        log_sink_push(message, length);
+        pthread_mutex_unlock(&log_sink.lock);
+        return;
+    }
+    pthread_mutex_unlock(&log_sink.lock);
+    // no writer thread. Messages logged outside server_start() are written right away
+    write_stderr(message, length);
+}
+
+/* Starts the thread writing messages, if it is not running yet. Every call needs a log_stop(). */
+void log_start()
+{
+    pthread_mutex_lock(&log_sink.lock);
+    if (log_sink.users++ == 0)
+    {
+        log_sink.running = 1;
+        if (pthread_create(&log_sink.thread, NULL, log_writer, NULL) != 0)
+        {
+            fprintf(stderr, "Could not start the log thread. Messages are written by the caller.\n");
+            log_sink.running = 0;
+        }
+    }
+    pthread_mutex_unlock(&log_sink.lock);
+}
+
+/* Writes the messages still buffered and stops the thread once the last user stopped. */
+void log_stop()
+{
+    pthread_mutex_lock(&log_sink.lock);
+    if (log_sink.users == 0 || --log_sink.users > 0 || !log_sink.running)
+    {
+        pthread_mutex_unlock(&log_sink.lock);
+        return;
+    }
+    log_sink.running = 0;
+    pthread_cond_signal(&log_sink.ready);
+    pthread_mutex_unlock(&log_sink.lock);
+    pthread_join(log_sink.thread, NULL);
+}
@@ -1,7 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "lru.h"
+#include "hash.h"
+
+// memfds held by cache nodes in the process, and how many they may hold
+static long num_memfds = 0;
+static long max_memfds = -1;
 
 cache_node *allocate_node(char *key, char *content_type, void *content, int content_length)
 {
@@ -19,6 +29,15 @@ cache_node *allocate_node(char *key, char *content_type, void *content, int cont
     node->content_type = content_type;
     node->content = content;
     node->content_length = content_length;
+    node->last_modified = 0;
+    node->last_modified_date[0] = '\0';
+    node->encodings = 0;
+    node->encoding = 0;
+    node->response = NULL;
+    node->header_length = 0;
+    node->refcount = 1;
+    node->memfd = -1;
+    snprintf(node->etag, sizeof(node->etag), "\"%016llx\"", (unsigned long long)hash64(content, content_length, 0));
     node->next = NULL;
     node->prev = NULL;
     return node;
@@ -34,7 +53,17 @@ void free_cache_node(cache_node *node)
     {
         free(node->key);
     }
-    if (node->content)
+    if (node->memfd >= 0)
+    {
+        munmap(node->response, node->header_length + node->content_length);
+        close(node->memfd);
+        __atomic_sub_fetch(&num_memfds, 1, __ATOMIC_RELAXED);
+    }
+    else if (node->response)
+    {
+        free(node->response); // holds the content as well
+    }
+    else if (node->content)
     {
         free(node->content); // dont miss this :)
     }
@@ -112,6 +141,7 @@ lru *lru_create(int max_size, int hashsize)
     lru_cache->head = NULL;
     lru_cache->tail = NULL;
     lru_cache->current_size = 0;
+    lru_cache->num_evictions = 0;
     lru_cache->max_size = max_size;
     lru_cache->table = hashtable_create(hashsize, NULL);
 
@@ -121,6 +151,7 @@ lru *lru_create(int max_size, int hashsize)
         exit(1);
     }
     lru_cache->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    lru_cache->mutex_stats = (lock_stats){0, 0, 0, 0, 0};
     return lru_cache;
 }
 
@@ -135,7 +166,7 @@ void destroy_cache(lru *lru_cache)
     while (node != NULL)
     {
         next = node->next;
-        free_cache_node(node);
+        cache_release(node);
         lru_cache->current_size--;
         node = next;
     }
@@ -149,6 +180,15 @@ void destroy_cache(lru *lru_cache)
 }
 
 cache_node *cache_put(lru *lru_cache, char *key, char *content_type, void *content, int content_length)
+{
+    return cache_put_file(lru_cache, key, content_type, content, content_length, 0);
+}
+
+/*
+ * Same as cache_put(), for content loaded from a file modified at last_modified.
+ * Pass 0 if the modification time is unknown; the node then has no Last-Modified date.
+ */
+cache_node *cache_put_file(lru *lru_cache, char *key, char *content_type, void *content, int content_length, time_t last_modified)
 {
     if (lru_cache == NULL)
     {
@@ -175,6 +215,16 @@ cache_node *cache_put(lru *lru_cache, char *key, char *content_type, void *conte
         return NULL;
     }
 
+    cache_node_set_last_modified(node, last_modified);
+    return cache_put_node(lru_cache, node);
+}
+
+/*
+ * Adds a node made with allocate_node() to the cache, evicting the least
+ * recently used node if the cache is full. The cache takes over the node.
+ */
+cache_node *cache_put_node(lru *lru_cache, cache_node *node)
+{
     // check if the cache is full
     if (lru_cache->current_size == lru_cache->max_size)
     {
@@ -182,17 +232,148 @@ cache_node *cache_put(lru *lru_cache, char *key, char *content_type, void *conte
         cache_node *lru_node = remove_tail(lru_cache);
         // remove the node from hashtable
         hashtable_delete(lru_cache->table, lru_node->key);
-        free_cache_node(lru_node);
+        // requests still sending the node keep it alive until they release it
+        cache_release(lru_node);
         lru_node = NULL;
+        __atomic_store_n(&lru_cache->num_evictions, lru_cache->num_evictions + 1, __ATOMIC_RELAXED);
     }
 
     // add the node to MRU side of linked list
     insert_at_head(lru_cache, node);
     // add the node to hashtable for O(1) access to the node
-    hashtable_put(lru_cache->table, key, node);
+    hashtable_put(lru_cache->table, node->key, node);
     return node;
 }
 
+/* Pass 0 if the modification time is unknown; the node then has no Last-Modified date. */
+void cache_node_set_last_modified(cache_node *node, time_t last_modified)
+{
+    if (last_modified != 0)
+    {
+        node->last_modified = last_modified;
+        http_format_date(last_modified, node->last_modified_date);
+    }
+}
+
+/*
+ * Lays out header and the content of node in one buffer, so the response can
+ * be sent as is. Must be called before the node is added to the cache.
+ * Returns 0, or -1 if out of memory, leaving node unchanged.
+ */
+int cache_node_set_response(cache_node *node, const char *header, int header_length)
+{
+    char *response = (char *)malloc(header_length + node->content_length);
+    if (response == NULL)
+    {
+        fprintf(stderr, "Could not allocate memory to the response of key=%s\n", node->key);
+        return -1;
+    }
+    memcpy(response, header, header_length);
+    memcpy(response + header_length, node->content, node->content_length);
+    if (node->response)
+    {
+        free(node->response);
+    }
+    else
+    {
+        free(node->content);
+    }
+    node->response = response;
+    node->header_length = header_length;
+    node->content = response + header_length;
+    return 0;
+}
+
+/*
+ * Moves the serialized response of node out of the heap into a memfd of its
+ * own, which responses are sent from with sendfile. response and content keep
+ * pointing at the bytes through a read-only shared mapping of the memfd.
+ * Must be called before the node is added to the cache.
+ * Contents smaller than CACHE_MEMFD_MIN_SIZE stay on the heap, and so does
+ * every node once the memfds of the process reach their share of the
+ * descriptor limit, so the cache never starves accept() of descriptors.
+ * Returns 0, 1 if the node stays on the heap, or -1 on error, leaving node unchanged.
+ */
+int cache_node_set_memfd(cache_node *node)
+{
+    size_t length = node->header_length + node->content_length;
+    if (node->response == NULL || node->memfd >= 0)
+    {
+        return -1;
+    }
+    if (node->content_length < CACHE_MEMFD_MIN_SIZE)
+    {
+        return 1;
+    }
+
+    long limit = __atomic_load_n(&max_memfds, __ATOMIC_RELAXED);
+    if (limit < 0)
+    {
+        struct rlimit rl;
+        limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (long)rl.rlim_cur / CACHE_MEMFD_FD_SHARE : 1024;
+        __atomic_store_n(&max_memfds, limit, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&num_memfds, 1, __ATOMIC_RELAXED) > limit)
+    {
+        __atomic_sub_fetch(&num_memfds, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    int fd = memfd_create("cserve-cache", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("Could not create memfd for cache entry");
+        __atomic_sub_fetch(&num_memfds, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t rv = write(fd, node->response + written, length - written);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+        {
+            perror("Could not write cache entry to memfd");
+            close(fd);
+            __atomic_sub_fetch(&num_memfds, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        written += rv;
+    }
+    char *response = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (response == MAP_FAILED)
+    {
+        perror("Could not map memfd of cache entry");
+        close(fd);
+        __atomic_sub_fetch(&num_memfds, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    free(node->response);
+    node->response = response;
+    node->content = response + node->header_length;
+    node->memfd = fd;
+    return 0;
+}
+
+/*
+ * Keeps node alive after it is evicted, until the matching cache_release().
+ * Call it while holding the cache's mutex, so the node cannot be evicted meanwhile.
+ */
+void cache_retain(cache_node *node)
+{
+    __atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference to node. Safe to call without the cache's mutex. */
+void cache_release(cache_node *node)
+{
+    if (node != NULL && __atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free_cache_node(node);
+    }
+}
+
 cache_node *cache_get(lru *lru_cache, char *key)
 {
     cache_node *node = hashtable_get(lru_cache->table, key);
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "server.h"
+
+// upper bounds of the latency buckets reported, in seconds
+static const double latency_bounds[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+static void metrics_counter(http_stream *stream, const char *name, const char *help, unsigned long value)
+{
+    http_stream_printf(stream, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+static void metrics_gauge(http_stream *stream, const char *name, const char *help, long value)
+{
+    http_stream_printf(stream, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", name, help, name, name, value);
+}
+
+/*
+ * Reports a merged latency histogram with the fixed buckets above. A bucket
+ * of the histogram counts towards a bound when all of its values fall below it.
+ */
+static void metrics_latency(http_stream *stream, const char *name, const char *label, const histogram *hist)
+{
+    int bucket = 0;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < sizeof(latency_bounds) / sizeof(latency_bounds[0]); i++)
+    {
+        uint64_t bound = (uint64_t)(latency_bounds[i] * 1e9);
+        while (bucket < HISTOGRAM_BUCKETS && histogram_bucket_limit(bucket) <= bound)
+        {
+            cumulative += hist->buckets[bucket++];
+        }
+        http_stream_printf(stream, "%s_bucket{%s,le=\"%g\"} %lu\n", name, label, latency_bounds[i], (unsigned long)cumulative);
+    }
+    while (bucket < HISTOGRAM_BUCKETS)
+    {
+        cumulative += hist->buckets[bucket++];
+    }
+    http_stream_printf(stream, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, label, (unsigned long)cumulative);
+    http_stream_printf(stream, "%s_sum{%s} %.9f\n", name, label, hist->sum / 1e9);
+    http_stream_printf(stream, "%s_count{%s} %lu\n", name, label, (unsigned long)cumulative);
+}
+
+/*
+ * Writes the labels of a route's series: its kind, so a route and a mount
+ * with the same prefix stay apart, and its key, escaped for the text format.
+ * The root mount has an empty key and is reported as "/".
+ */
+static void metrics_route_label(route_node *node, char *label, size_t size)
+{
+    const char *key = node->key[0] != '\0' ? node->key : "/";
+    size_t length = snprintf(label, size, "kind=\"%s\",route=\"", node->is_mount ? "mount" : "route");
+    for (const char *c = key; *c != '\0' && length + 4 < size; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            label[length++] = '\\';
+            label[length++] = *c;
+        }
+        else if (*c == '\n')
+        {
+            label[length++] = '\\';
+            label[length++] = 'n';
+        }
+        else
+        {
+            label[length++] = *c;
+        }
+    }
+    label[length++] = '"';
+    label[length] = '\0';
+}
+
+static void metrics_route_requests(route_node *node, void *stream)
+{
+    char label[512];
+    metrics_route_label(node, label, sizeof(label));
+    http_stream_printf((http_stream *)stream, "cserve_route_requests_total{%s} %lu\n", label, (unsigned long)__atomic_load_n(&node->stats->requests, __ATOMIC_RELAXED));
+}
+
+static void metrics_route_bytes(route_node *node, void *stream)
+{
+    char label[512];
+    metrics_route_label(node, label, sizeof(label));
+    http_stream_printf((http_stream *)stream, "cserve_route_sent_bytes_total{%s} %lu\n", label, (unsigned long)__atomic_load_n(&node->stats->bytes_sent, __ATOMIC_RELAXED));
+}
+
+static void metrics_route_cpu(route_node *node, void *stream)
+{
+    char label[512];
+    metrics_route_label(node, label, sizeof(label));
+    http_stream_printf((http_stream *)stream, "cserve_route_cpu_seconds_total{%s} %.9f\n", label, __atomic_load_n(&node->stats->cpu_ns, __ATOMIC_RELAXED) / 1e9);
+}
+
+typedef struct metrics_context
+{
+    http_stream *stream;
+    histogram *merged;
+} metrics_context;
+
+static void metrics_route_latency(route_node *node, void *arg)
+{
+    metrics_context *context = (metrics_context *)arg;
+    char label[512];
+    metrics_route_label(node, label, sizeof(label));
+    // workers keep recording. Report a snapshot
+    memset(context->merged, 0, sizeof(histogram));
+    histogram_merge(context->merged, &node->stats->latency);
+    metrics_latency(context->stream, "cserve_route_duration_seconds", label, context->merged);
+}
+
+/*
+ * Route handler reporting the server's statistics in the Prometheus text
+ * format. Counters are read from every worker while they keep running.
+ */
+void metrics_response(void *server_ptr, int new_socket_fd, const char *path, void *args)
+{
+    (void)path;
+    (void)args;
+    http_server *server = (http_server *)server_ptr;
+    histogram *merged = (histogram *)malloc(sizeof(histogram));
+    if (merged == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to metrics histogram.\n");
+        return;
+    }
+    http_stream stream;
+    if (http_stream_begin(&stream, server, new_socket_fd, HEADER_OK, METRICS_CONTENT_TYPE, "Cache-Control: no-store\n") < 0)
+    {
+        free(merged);
+        return;
+    }
+
+    metrics_counter(&stream, "cserve_requests_total", "Requests served.", server_stats_counter(server->stats, STATS_REQUESTS));
+    metrics_counter(&stream, "cserve_get_requests_total", "GET requests received.", server_stats_counter(server->stats, STATS_GET_REQUESTS));
+    metrics_counter(&stream, "cserve_received_bytes_total", "Bytes of requests received.", server_stats_counter(server->stats, STATS_BYTES_RECEIVED));
+    metrics_counter(&stream, "cserve_sent_bytes_total", "Bytes of responses sent.", server_stats_counter(server->stats, STATS_BYTES_SENT));
+    if (server->cache != NULL)
+    {
+        metrics_counter(&stream, "cserve_cache_hits_total", "Files found in the cache.", __atomic_load_n(&server->server_logs->cache_hits, __ATOMIC_RELAXED));
+        metrics_counter(&stream, "cserve_cache_misses_total", "Files loaded into the cache.", __atomic_load_n(&server->server_logs->cache_miss, __ATOMIC_RELAXED));
+        metrics_counter(&stream, "cserve_cache_evictions_total", "Files evicted from the cache.", __atomic_load_n(&server->cache->num_evictions, __ATOMIC_RELAXED));
+        metrics_gauge(&stream, "cserve_cache_entries", "Files in the cache.", __atomic_load_n(&server->cache->current_size, __ATOMIC_RELAXED));
+    }
+
+    worker_queue_stats queue_stats[SERVER_MAX_QUEUES];
+    int num_queues = server_queue_stats(server, queue_stats, SERVER_MAX_QUEUES);
+    http_stream_printf(&stream, "# HELP cserve_queue_depth Connections waiting for a worker.\n# TYPE cserve_queue_depth gauge\n");
+    for (int i = 0; i < num_queues; i++)
+    {
+        http_stream_printf(&stream, "cserve_queue_depth{queue=\"%d\"} %d\n", i, queue_stats[i].depth);
+    }
+    http_stream_printf(&stream, "# HELP cserve_queue_max_depth Most connections ever waiting for a worker.\n# TYPE cserve_queue_max_depth gauge\n");
+    for (int i = 0; i < num_queues; i++)
+    {
+        http_stream_printf(&stream, "cserve_queue_max_depth{queue=\"%d\"} %d\n", i, queue_stats[i].max_depth);
+    }
+    http_stream_printf(&stream, "# HELP cserve_queue_connections_total Connections queued for a worker.\n# TYPE cserve_queue_connections_total counter\n");
+    for (int i = 0; i < num_queues; i++)
+    {
+        http_stream_printf(&stream, "cserve_queue_connections_total{queue=\"%d\"} %ld\n", i, queue_stats[i].num_enqueued);
+    }
+    http_stream_printf(&stream, "# HELP cserve_queue_wait_seconds Time from accepting a connection until a worker took it.\n# TYPE cserve_queue_wait_seconds histogram\n");
+    for (int i = 0; i < num_queues; i++)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "queue=\"%d\"", i);
+        memset(merged, 0, sizeof(histogram));
+        server_queue_wait(server, i, merged);
+        metrics_latency(&stream, "cserve_queue_wait_seconds", label, merged);
+    }
+    if (server->access_log != NULL)
+    {
+        metrics_counter(&stream, "cserve_access_log_dropped_total", "Access log records dropped while the writer fell behind.", access_log_dropped(server->access_log));
+    }
+    if (server->output != NULL)
+    {
+        metrics_gauge(&stream, "cserve_output_connections", "Connections still sending their response.", __atomic_load_n(&server->output->num_queues, __ATOMIC_RELAXED));
+    }
+#ifdef CSERVE_LOCKSTAT
+    lock_stats locks[SERVER_LOCK_COUNT];
+    for (int i = 0; i < SERVER_LOCK_COUNT; i++)
+    {
+        server_lock_stats(server, i, &locks[i]);
+    }
+    http_stream_printf(&stream, "# HELP cserve_lock_acquisitions_total Times the mutex was taken.\n# TYPE cserve_lock_acquisitions_total counter\n");
+    for (int i = 0; i < SERVER_LOCK_COUNT; i++)
+    {
+        http_stream_printf(&stream, "cserve_lock_acquisitions_total{lock=\"%s\"} %lu\n", server_lock_name(i), (unsigned long)locks[i].acquisitions);
+    }
+    http_stream_printf(&stream, "# HELP cserve_lock_contended_total Times the mutex was found held.\n# TYPE cserve_lock_contended_total counter\n");
+    for (int i = 0; i < SERVER_LOCK_COUNT; i++)
+    {
+        http_stream_printf(&stream, "cserve_lock_contended_total{lock=\"%s\"} %lu\n", server_lock_name(i), (unsigned long)locks[i].contended);
+    }
+    http_stream_printf(&stream, "# HELP cserve_lock_wait_seconds_total Time spent waiting for the mutex.\n# TYPE cserve_lock_wait_seconds_total counter\n");
+    for (int i = 0; i < SERVER_LOCK_COUNT; i++)
+    {
+        http_stream_printf(&stream, "cserve_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", server_lock_name(i), locks[i].wait_ns / 1e9);
+    }
+    http_stream_printf(&stream, "# HELP cserve_lock_hold_seconds_total Time the mutex was held.\n# TYPE cserve_lock_hold_seconds_total counter\n");
+    for (int i = 0; i < SERVER_LOCK_COUNT; i++)
+    {
+        http_stream_printf(&stream, "cserve_lock_hold_seconds_total{lock=\"%s\"} %.9f\n", server_lock_name(i), locks[i].hold_ns / 1e9);
+    }
+#endif
+
+    http_stream_printf(&stream, "# HELP cserve_request_duration_seconds Time spent on requests by stage.\n# TYPE cserve_request_duration_seconds histogram\n");
+    for (int stage = 0; stage < STATS_NUM_STAGES; stage++)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "stage=\"%s\"", server_stats_stage_name(stage));
+        memset(merged, 0, sizeof(histogram));
+        server_stats_latency(server->stats, stage, merged);
+        metrics_latency(&stream, "cserve_request_duration_seconds", label, merged);
+    }
+
+    // one series per route and mount, labelled with its kind and key
+    http_stream_printf(&stream, "# HELP cserve_route_requests_total Requests served by the route.\n# TYPE cserve_route_requests_total counter\n");
+    route_foreach(server->route_table, metrics_route_requests, &stream);
+    http_stream_printf(&stream, "# HELP cserve_route_sent_bytes_total Bytes sent by the route.\n# TYPE cserve_route_sent_bytes_total counter\n");
+    route_foreach(server->route_table, metrics_route_bytes, &stream);
+    http_stream_printf(&stream, "# HELP cserve_route_cpu_seconds_total CPU time of the route's handler function.\n# TYPE cserve_route_cpu_seconds_total counter\n");
+    route_foreach(server->route_table, metrics_route_cpu, &stream);
+    http_stream_printf(&stream, "# HELP cserve_route_duration_seconds Time spent responding by route.\n# TYPE cserve_route_duration_seconds histogram\n");
+    metrics_context context = {&stream, merged};
+    route_foreach(server->route_table, metrics_route_latency, &context);
+    http_stream_end(&stream);
+    free(merged);
+}
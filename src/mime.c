@@ -58,4 +58,16 @@ char *mime_type_get(char *filename)
     }
 
     return DEFAULT_MIME_TYPE;
+}
+
+/*
+ * Returns 1 if content of mime_type is text that shrinks when compressed.
+ */
+int mime_type_compressible(const char *mime_type)
+{
+    return strncmp(mime_type, "text/", 5) == 0 ||
+           strcmp(mime_type, "application/javascript") == 0 ||
+           strcmp(mime_type, "application/json") == 0 ||
+           strcmp(mime_type, "application/xml") == 0 ||
+           strcmp(mime_type, "image/svg+xml") == 0;
 }
\ No newline at end of file
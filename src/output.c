@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "output.h"
+#include "log.h"
+
+#define OUTPUT_MAX_EVENTS 64
+#define OUTPUT_POLL_INTERVAL 1000 // ms
+#define OUTPUT_DRAIN_TIMEOUT 2000 // ms to finish the queues still pending when the loop stops
+
+void output_queue_init(output_queue *queue, int socket_fd)
+{
+    queue->socket_fd = socket_fd;
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->queued_bytes = 0;
+    queue->last_progress = 0;
+    queue->next = NULL;
+    queue->prev = NULL;
+}
+
+static void output_segment_free(output_segment *segment)
+{
+    if (segment->fd >= 0)
+    {
+        close(segment->fd);
+    }
+    if (segment->release)
+    {
+        segment->release(segment->arg);
+    }
+    free(segment);
+}
+
+static void output_append(output_queue *queue, output_segment *segment)
+{
+    segment->next = NULL;
+    if (queue->tail)
+        queue->tail->next = segment;
+    else
+        queue->head = segment;
+    queue->tail = segment;
+    queue->queued_bytes += segment->length;
+}
+
+/* Queues a copy of data. Returns 0, or -1 if out of memory. */
+static int output_queue_copy(output_queue *queue, const char *data, size_t length)
+{
+    // the copy lives in the same allocation as the segment
+    output_segment *segment = (output_segment *)malloc(sizeof(output_segment) + length);
+    if (segment == NULL)
+    {
+        log_error("Error allocating memory to output segment.\n");
+        return -1;
+    }
+    memcpy(segment + 1, data, length);
+    segment->data = (const char *)(segment + 1);
+    segment->fd = -1;
+    segment->offset = 0;
+    segment->length = length;
+    segment->release = NULL;
+    segment->arg = NULL;
+    output_append(queue, segment);
+    return 0;
+}
+
+/* Queues a reference to data. Returns 0, or -1 if out of memory. */
+static int output_queue_borrowed(output_queue *queue, const char *data, size_t length, void (*release)(void *), void *arg)
+{
+    output_segment *segment = (output_segment *)malloc(sizeof(output_segment));
+    if (segment == NULL)
+    {
+        log_error("Error allocating memory to output segment.\n");
+        return -1;
+    }
+    segment->data = data;
+    segment->fd = -1;
+    segment->offset = 0;
+    segment->length = length;
+    segment->release = release;
+    segment->arg = arg;
+    output_append(queue, segment);
+    return 0;
+}
+
+/*
+ * Sends iov, queueing whatever the socket does not accept now. The first
+ * borrowed iovecs are copied into the queue; iov[borrowed] onwards are only
+ * referenced, and release(arg) is called once they are no longer needed,
+ * right away if they were sent. Pass iovcnt and NULL if nothing is borrowed.
+ * flags are passed on to sendmsg, e.g. MSG_MORE.
+ * Returns the number of bytes sent or queued, or -1 if the connection failed.
+ */
+long output_writev(output_queue *queue, struct iovec *iov, int iovcnt, int flags, int borrowed, void (*release)(void *), void *arg)
+{
+    long total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    int index = 0;
+    if (queue->head == NULL)
+    {
+        while (index < iovcnt)
+        {
+            struct msghdr msg = {0};
+            msg.msg_iov = iov + index;
+            msg.msg_iovlen = iovcnt - index;
+            long rv = sendmsg(queue->socket_fd, &msg, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (rv < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                log_warn("Could not send response: %s\n", strerror(errno));
+                if (release)
+                    release(arg);
+                return -1;
+            }
+            while (index < iovcnt && (size_t)rv >= iov[index].iov_len)
+            {
+                rv -= iov[index].iov_len;
+                index++;
+            }
+            if (index < iovcnt)
+            {
+                iov[index].iov_base = (char *)iov[index].iov_base + rv;
+                iov[index].iov_len -= rv;
+            }
+        }
+    }
+
+    // the socket is full. The rest waits in the queue
+    int released = 0;
+    for (; index < iovcnt; index++)
+    {
+        if (iov[index].iov_len == 0 && index < borrowed)
+            continue;
+        int rv;
+        if (index < borrowed)
+        {
+            rv = output_queue_copy(queue, iov[index].iov_base, iov[index].iov_len);
+        }
+        else
+        {
+            // the last borrowed segment hands the data back
+            int last = index == iovcnt - 1;
+            rv = output_queue_borrowed(queue, iov[index].iov_base, iov[index].iov_len, last ? release : NULL, last ? arg : NULL);
+            released |= last && rv == 0;
+        }
+        if (rv < 0)
+        {
+            break;
+        }
+    }
+    if (!released && release)
+    {
+        release(arg);
+    }
+    return index < iovcnt ? -1 : total;
+}
+
+/*
+ * Sends length bytes of fd from offset, queueing whatever the socket does not
+ * accept now. The queue keeps its own duplicate of fd, so the caller may close it.
+ * Returns the number of bytes sent or queued, or -1 if the connection failed.
+ */
+long output_sendfile(output_queue *queue, int fd, size_t offset, size_t length)
+{
+    off_t file_offset = offset;
+    size_t sent = 0;
+    if (queue->head == NULL)
+    {
+        while (sent < length)
+        {
+            long rv = sendfile(queue->socket_fd, fd, &file_offset, length - sent);
+            if (rv < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                log_warn("Could not send response: %s\n", strerror(errno));
+                return sent > 0 ? (long)sent : -1;
+            }
+            if (rv == 0)
+            {
+                // the file is shorter than it was
+                return sent;
+            }
+            sent += rv;
+        }
+    }
+    if (sent == length)
+    {
+        return sent;
+    }
+
+    output_segment *segment = (output_segment *)malloc(sizeof(output_segment));
+    int queued_fd = dup(fd);
+    if (segment == NULL || queued_fd < 0)
+    {
+        log_error("Could not queue the rest of the file for sending.\n");
+        free(segment);
+        if (queued_fd >= 0)
+            close(queued_fd);
+        return -1;
+    }
+    segment->data = NULL;
+    segment->fd = queued_fd;
+    segment->offset = file_offset;
+    segment->length = length - sent;
+    segment->release = NULL;
+    segment->arg = NULL;
+    output_append(queue, segment);
+    return length;
+}
+
+int output_pending(output_queue *queue)
+{
+    return queue->head != NULL;
+}
+
+/*
+ * Sends as much of the queue as the socket accepts.
+ * Returns 1 once the queue is empty, 0 if the socket is full, -1 on error.
+ */
+int output_flush(output_queue *queue)
+{
+    while (queue->head != NULL)
+    {
+        output_segment *segment = queue->head;
+        long rv;
+        if (segment->data != NULL)
+        {
+            rv = send(queue->socket_fd, segment->data + segment->offset, segment->length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        else
+        {
+            off_t file_offset = segment->offset;
+            rv = sendfile(queue->socket_fd, segment->fd, &file_offset, segment->length);
+            if (rv == 0)
+            {
+                return -1;
+            }
+        }
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        segment->offset += rv;
+        segment->length -= rv;
+        queue->queued_bytes -= rv;
+        queue->last_progress = time(NULL);
+        if (segment->length == 0)
+        {
+            queue->head = segment->next;
+            if (queue->head == NULL)
+                queue->tail = NULL;
+            output_segment_free(segment);
+        }
+    }
+    return 1;
+}
+
+/* Drops everything still queued. */
+void output_discard(output_queue *queue)
+{
+    while (queue->head != NULL)
+    {
+        output_segment *segment = queue->head;
+        queue->head = segment->next;
+        output_segment_free(segment);
+    }
+    queue->tail = NULL;
+    queue->queued_bytes = 0;
+}
+
+static void output_close(output_queue *queue)
+{
+    output_discard(queue);
+    shutdown(queue->socket_fd, SHUT_RDWR);
+    close(queue->socket_fd);
+}
+
+// sends the queue on the calling thread, for when the loop cannot take it
+static void output_drain(output_queue *queue)
+{
+    int rv;
+    while ((rv = output_flush(queue)) == 0)
+    {
+        if (poll(&(struct pollfd){queue->socket_fd, POLLOUT, 0}, 1, OUTPUT_IDLE_TIMEOUT * 1000) <= 0)
+        {
+            break;
+        }
+    }
+    output_close(queue);
+}
+
+// call with loop->lock held
+static void output_loop_finish(output_loop *loop, output_queue *queue)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, queue->socket_fd, NULL);
+    if (queue->prev)
+        queue->prev->next = queue->next;
+    else
+        loop->queues = queue->next;
+    if (queue->next)
+        queue->next->prev = queue->prev;
+    loop->num_queues--;
+    output_close(queue);
+    free(queue);
+}
+
+static void *output_loop_run(void *arg)
+{
+    output_loop *loop = (output_loop *)arg;
+    struct epoll_event events[OUTPUT_MAX_EVENTS];
+    struct timespec stop_at = {0, 0};
+    time_t last_sweep = time(NULL);
+
+    for (;;)
+    {
+        if (!__atomic_load_n(&loop->running, __ATOMIC_ACQUIRE))
+        {
+            // stopping. Let the slow clients have their responses for a little longer
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (stop_at.tv_sec == 0)
+                stop_at.tv_sec = now.tv_sec + OUTPUT_DRAIN_TIMEOUT / 1000;
+            pthread_mutex_lock(&loop->lock);
+            int num_queues = loop->num_queues;
+            pthread_mutex_unlock(&loop->lock);
+            if (num_queues == 0 || now.tv_sec >= stop_at.tv_sec)
+                break;
+        }
+
+        int n = epoll_wait(loop->epoll_fd, events, OUTPUT_MAX_EVENTS, OUTPUT_POLL_INTERVAL);
+        pthread_mutex_lock(&loop->lock);
+        for (int i = 0; i < n; i++)
+        {
+            output_queue *queue = (output_queue *)events[i].data.ptr;
+            if (output_flush(queue) != 0)
+            {
+                output_loop_finish(loop, queue);
+            }
+        }
+
+        // clients that stopped reading lose their connection instead of holding memory forever
+        time_t now = time(NULL);
+        if (now != last_sweep)
+        {
+            last_sweep = now;
+            output_queue *queue = loop->queues;
+            while (queue != NULL)
+            {
+                output_queue *next = queue->next;
+                if (now - queue->last_progress > OUTPUT_IDLE_TIMEOUT)
+                {
+                    log_info("Dropping a connection that did not read its response for %d seconds.\n", OUTPUT_IDLE_TIMEOUT);
+                    output_loop_finish(loop, queue);
+                }
+                queue = next;
+            }
+        }
+        pthread_mutex_unlock(&loop->lock);
+    }
+    return NULL;
+}
+
+/* Starts the thread that sends the queued output. Returns NULL on error. */
+output_loop *output_loop_create()
+{
+    output_loop *loop = (output_loop *)malloc(sizeof(output_loop));
+    if (loop == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to output_loop.\n");
+        return NULL;
+    }
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        perror("Could not create epoll instance for output");
+        free(loop);
+        return NULL;
+    }
+    loop->running = 1;
+    loop->lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    loop->queues = NULL;
+    loop->num_queues = 0;
+    if (pthread_create(&loop->thread, NULL, output_loop_run, loop) != 0)
+    {
+        fprintf(stderr, "Could not start the output thread.\n");
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+/*
+ * Hands a connection with queued output to the loop, which sends the rest
+ * when the socket becomes writable and then closes it. The loop takes over
+ * the socket and the segments; queue itself is left empty and may be reused.
+ * Without a loop, the output is sent on the calling thread instead.
+ */
+void output_loop_add(output_loop *loop, output_queue *queue)
+{
+    output_queue *moved = loop ? (output_queue *)malloc(sizeof(output_queue)) : NULL;
+    if (moved == NULL)
+    {
+        output_drain(queue);
+        return;
+    }
+    *moved = *queue;
+    moved->last_progress = time(NULL);
+    moved->prev = NULL;
+    output_queue_init(queue, -1);
+
+    pthread_mutex_lock(&loop->lock);
+    moved->next = loop->queues;
+    if (loop->queues)
+        loop->queues->prev = moved;
+    loop->queues = moved;
+    loop->num_queues++;
+    // edge triggered: one wakeup per transition to writable. Errors and hangups are always reported
+    struct epoll_event event = {.events = EPOLLOUT | EPOLLET, .data.ptr = moved};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, moved->socket_fd, &event) == 0)
+    {
+        pthread_mutex_unlock(&loop->lock);
+        return;
+    }
+    perror("Could not watch connection for output");
+    if (moved->next)
+        moved->next->prev = NULL;
+    loop->queues = moved->next;
+    loop->num_queues--;
+    pthread_mutex_unlock(&loop->lock);
+    output_drain(moved);
+    free(moved);
+}
+
+/*
+ * Stops the loop after giving the pending connections up to
+ * OUTPUT_DRAIN_TIMEOUT to take their output. The rest are closed.
+ */
+void output_loop_destroy(output_loop *loop)
+{
+    if (loop == NULL)
+    {
+        return;
+    }
+    __atomic_store_n(&loop->running, 0, __ATOMIC_RELEASE);
+    pthread_join(loop->thread, NULL);
+
+    pthread_mutex_lock(&loop->lock);
+    while (loop->queues != NULL)
+    {
+        output_loop_finish(loop, loop->queues);
+    }
+    pthread_mutex_unlock(&loop->lock);
+    close(loop->epoll_fd);
+    free(loop);
+}
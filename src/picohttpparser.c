@@ -27,12 +27,10 @@
 #include <assert.h>
 #include <stddef.h>
 #include <string.h>
-#ifdef __SSE4_2__
-#ifdef _MSC_VER
-#include <nmmintrin.h>
-#else
-#include <x86intrin.h>
-#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* SIMD scanners are compiled with target attributes and picked at runtime, see phr_simd_select() */
+#define PHR_SIMD_DISPATCH 1
+#include <immintrin.h>
 #endif
 #include "picohttpparser.h"
 
@@ -111,10 +109,23 @@ static const char *token_char_map = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
-static const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+typedef const char *(*findchar_fn)(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found);
+
+static const char *findchar_scalar(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+{
+    *found = 0;
+    /* suppress unused parameter warning */
+    (void)buf_end;
+    (void)ranges;
+    (void)ranges_size;
+    return buf;
+}
+
+#ifdef PHR_SIMD_DISPATCH
+__attribute__((target("sse4.2"))) static const char *findchar_sse42(const char *buf, const char *buf_end, const char *ranges,
+                                                                    size_t ranges_size, int *found)
 {
     *found = 0;
-#if __SSE4_2__
     if (likely(buf_end - buf >= 16))
     {
         __m128i ranges16 = _mm_loadu_si128((const __m128i *)ranges);
@@ -134,20 +145,119 @@ static const char *findchar_fast(const char *buf, const char *buf_end, const cha
             left -= 16;
         } while (likely(left != 0));
     }
+    return buf;
+}
+
+/* There is no 32 byte pcmpestri; every range is tested as lo <= c && c <= hi using unsigned min/max, 32 bytes at a time.
+ * Up to three ranges are kept in registers, which covers header values and the request line. Longer range lists
+ * (token characters) and tails shorter than 32 bytes go through pcmpestri; every AVX2 CPU also has SSE4.2. */
+#define AVX2_IN_RANGE(b32, lo, hi) _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(b32, lo), b32), _mm256_cmpeq_epi8(_mm256_min_epu8(b32, hi), b32))
+
+__attribute__((target("avx2,sse4.2"))) static const char *findchar_avx2(const char *buf, const char *buf_end, const char *ranges,
+                                                                        size_t ranges_size, int *found)
+{
+    *found = 0;
+    if (likely(ranges_size <= 6) && likely(buf_end - buf >= 32))
+    {
+        /* unused ranges repeat the first one */
+        const char *r1 = ranges_size > 2 ? ranges + 2 : ranges, *r2 = ranges_size > 4 ? ranges + 4 : ranges;
+        __m256i lo0 = _mm256_set1_epi8(ranges[0]), hi0 = _mm256_set1_epi8(ranges[1]);
+        __m256i lo1 = _mm256_set1_epi8(r1[0]), hi1 = _mm256_set1_epi8(r1[1]);
+        __m256i lo2 = _mm256_set1_epi8(r2[0]), hi2 = _mm256_set1_epi8(r2[1]);
+
+        size_t left = (buf_end - buf) & ~31;
+        do
+        {
+            __m256i b32 = _mm256_loadu_si256((const __m256i *)buf);
+            __m256i match = _mm256_or_si256(_mm256_or_si256(AVX2_IN_RANGE(b32, lo0, hi0), AVX2_IN_RANGE(b32, lo1, hi1)),
+                                            AVX2_IN_RANGE(b32, lo2, hi2));
+            unsigned mask = (unsigned)_mm256_movemask_epi8(match);
+            if (unlikely(mask != 0))
+            {
+                *found = 1;
+                return buf + __builtin_ctz(mask);
+            }
+            buf += 32;
+            left -= 32;
+        } while (likely(left != 0));
+    }
+    return findchar_sse42(buf, buf_end, ranges, ranges_size, found);
+}
+
+#undef AVX2_IN_RANGE
+#endif
+
+static const findchar_fn findchar_impls[PHR_SIMD_COUNT] = {
+    findchar_scalar,
+#ifdef PHR_SIMD_DISPATCH
+    findchar_sse42,
+    findchar_avx2,
 #else
-    /* suppress unused parameter warning */
-    (void)buf_end;
-    (void)ranges;
-    (void)ranges_size;
+    findchar_scalar,
+    findchar_scalar,
 #endif
-    return buf;
+};
+
+static const char *simd_names[PHR_SIMD_COUNT] = {"scalar", "sse4.2", "avx2"};
+
+static int simd_current = PHR_SIMD_SCALAR;
+static findchar_fn findchar_fast = findchar_scalar;
+
+int phr_simd_supported(int simd)
+{
+    switch (simd)
+    {
+    case PHR_SIMD_SCALAR:
+        return 1;
+#ifdef PHR_SIMD_DISPATCH
+    case PHR_SIMD_SSE42:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+    case PHR_SIMD_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+int phr_simd_select(int simd)
+{
+    if (!phr_simd_supported(simd))
+        return -1;
+    simd_current = simd;
+    findchar_fast = findchar_impls[simd];
+    return 0;
 }
 
+int phr_simd_current(void)
+{
+    return simd_current;
+}
+
+const char *phr_simd_name(int simd)
+{
+    if (simd < 0 || simd >= PHR_SIMD_COUNT)
+        return "unknown";
+    return simd_names[simd];
+}
+
+#if __GNUC__ >= 3
+/* start with the widest scanner the CPU has; phr_simd_select() may replace it before parsing starts */
+__attribute__((constructor)) static void phr_simd_init(void)
+{
+    int simd;
+    for (simd = PHR_SIMD_COUNT - 1; simd > PHR_SIMD_SCALAR; --simd)
+        if (phr_simd_select(simd) == 0)
+            break;
+}
+#endif
+
 static const char *get_token_to_eol(const char *buf, const char *buf_end, const char **token, size_t *token_len, int *ret)
 {
     const char *token_start = buf;
 
-#ifdef __SSE4_2__
     static const char ALIGNED(16) ranges1[16] = "\0\010"    /* allow HT */
                                                 "\012\037"  /* allow SP and up to but not including DEL */
                                                 "\177\177"; /* allow chars w. MSB set */
@@ -155,8 +265,9 @@ static const char *get_token_to_eol(const char *buf, const char *buf_end, const
     buf = findchar_fast(buf, buf_end, ranges1, 6, &found);
     if (found)
         goto FOUND_CTL;
-#else
-    /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined */
+
+    /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined.
+     * With a SIMD scanner this only sees the tail it left behind */
     while (likely(buf_end - buf >= 8))
     {
 #define DOIT()                                   \
@@ -183,7 +294,6 @@ static const char *get_token_to_eol(const char *buf, const char *buf_end, const
         }
         ++buf;
     }
-#endif
     for (;; ++buf)
     {
         CHECK_EOF();
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "policy.h"
+#include "http.h"
+
+/*
+ * Sets up policy and formats its Cache-Control line. max_age is ignored by
+ * CACHE_POLICY_NO_CACHE and CACHE_POLICY_NO_STORE and required otherwise.
+ * Returns 0, or -1 if the combination is invalid.
+ */
+int cache_policy_init(cache_policy *policy, long max_age, int flags)
+{
+    policy->header[0] = '\0';
+    if (flags & CACHE_POLICY_NO_STORE)
+    {
+        policy->max_age = -1;
+        policy->flags = CACHE_POLICY_NO_STORE;
+        snprintf(policy->header, sizeof(policy->header), "Cache-Control: no-store\n");
+        return 0;
+    }
+    if (flags & CACHE_POLICY_NO_CACHE)
+    {
+        policy->max_age = -1;
+        policy->flags = CACHE_POLICY_NO_CACHE;
+        snprintf(policy->header, sizeof(policy->header), "Cache-Control: no-cache\n");
+        return 0;
+    }
+    if (max_age < 0)
+    {
+        fprintf(stderr, "A cache policy needs a max-age unless it is no-cache or no-store.\n");
+        return -1;
+    }
+    policy->max_age = max_age;
+    policy->flags = flags & CACHE_POLICY_IMMUTABLE;
+    snprintf(
+        policy->header, sizeof(policy->header), "Cache-Control: public, max-age=%ld%s\n",
+        max_age, (flags & CACHE_POLICY_IMMUTABLE) ? ", immutable" : "");
+    return 0;
+}
+
+/*
+ * Writes the Expires line HTTP/1.0 clients need in place of Cache-Control.
+ * Responses that must not be reused expire immediately.
+ * Returns the length written, 0 if the policy is unset.
+ */
+size_t cache_policy_expires(const cache_policy *policy, time_t now, char *buffer, size_t size)
+{
+    char date[HTTP_DATE_SIZE];
+    if (policy == NULL || policy->header[0] == '\0')
+        return 0;
+    http_format_date(policy->max_age > 0 ? now + policy->max_age : now, date);
+    int length = snprintf(buffer, size, "Expires: %s\n", date);
+    return length < (int)size ? (size_t)length : 0;
+}
+
+cache_policy_map *cache_policy_map_create()
+{
+    cache_policy_map *map = (cache_policy_map *)malloc(sizeof(cache_policy_map));
+    if (map == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to cache_policy_map.\n");
+        return NULL;
+    }
+    map->extensions = NULL;
+    map->policies = NULL;
+    map->num_policies = 0;
+    return map;
+}
+
+static int find_extension(cache_policy_map *map, const char *extension)
+{
+    for (int i = 0; i < map->num_policies; i++)
+    {
+        if (strcasecmp(map->extensions[i], extension) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Sets the policy of files with extension, e.g. "css" or ".css".
+ * Setting an extension again replaces its policy. Returns 0, or -1 on error.
+ */
+int cache_policy_map_set(cache_policy_map *map, const char *extension, long max_age, int flags)
+{
+    if (map == NULL || extension == NULL)
+        return -1;
+    if (extension[0] == '.')
+        extension++;
+
+    cache_policy policy;
+    if (cache_policy_init(&policy, max_age, flags) < 0)
+        return -1;
+
+    int index = find_extension(map, extension);
+    if (index >= 0)
+    {
+        map->policies[index] = policy;
+        return 0;
+    }
+
+    char **extensions = (char **)realloc(map->extensions, sizeof(char *) * (map->num_policies + 1));
+    if (extensions != NULL)
+        map->extensions = extensions;
+    cache_policy *policies = (cache_policy *)realloc(map->policies, sizeof(cache_policy) * (map->num_policies + 1));
+    if (policies != NULL)
+        map->policies = policies;
+    char *copy = strdup(extension);
+    if (extensions == NULL || policies == NULL || copy == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to cache policy of %s.\n", extension);
+        free(copy);
+        return -1;
+    }
+    for (char *p = copy; *p; p++)
+        *p = tolower((unsigned char)*p);
+
+    map->extensions[map->num_policies] = copy;
+    map->policies[map->num_policies] = policy;
+    map->num_policies++;
+    return 0;
+}
+
+/*
+ * Returns the policy for the extension of the file at path, or NULL.
+ */
+const cache_policy *cache_policy_map_get(cache_policy_map *map, const char *path)
+{
+    if (map == NULL || map->num_policies == 0)
+        return NULL;
+    const char *extension = strrchr(path, '.');
+    if (extension == NULL || strchr(extension, '/') != NULL)
+        return NULL;
+    int index = find_extension(map, extension + 1);
+    return index >= 0 ? &map->policies[index] : NULL;
+}
+
+void cache_policy_map_destroy(cache_policy_map *map)
+{
+    if (map == NULL)
+        return;
+    for (int i = 0; i < map->num_policies; i++)
+        free(map->extensions[i]);
+    free(map->extensions);
+    free(map->policies);
+    free(map);
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "pool.h"
+
+#define POOL_ALIGNMENT 16
+#define ALIGN_UP(n, a) (((n) + (a)-1) & ~((size_t)(a)-1))
+
+typedef struct pool_object
+{
+    struct pool_object *next;
+} pool_object;
+
+typedef struct pool_slab
+{
+    struct pool_slab *next;
+} pool_slab;
+
+pool *pool_create(size_t object_size, int objects_per_slab)
+{
+    pool *pool_ptr = (pool *)malloc(sizeof(pool));
+
+    if (pool_ptr == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to pool.\n");
+        return NULL;
+    }
+
+    if (object_size < sizeof(pool_object))
+    {
+        object_size = sizeof(pool_object);
+    }
+    pool_ptr->object_size = ALIGN_UP(object_size, POOL_ALIGNMENT);
+    pool_ptr->objects_per_slab = objects_per_slab > 0 ? objects_per_slab : 64;
+    pool_ptr->free_list = NULL;
+    pool_ptr->remote_free = NULL;
+    pool_ptr->slabs = NULL;
+    pool_ptr->num_slabs = 0;
+    return pool_ptr;
+}
+
+int pool_grow(pool *pool_ptr)
+{
+    size_t header = ALIGN_UP(sizeof(pool_slab), POOL_ALIGNMENT);
+    pool_slab *slab = (pool_slab *)malloc(header + pool_ptr->object_size * pool_ptr->objects_per_slab);
+
+    if (slab == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to pool slab.\n");
+        return -1;
+    }
+
+    slab->next = (pool_slab *)pool_ptr->slabs;
+    pool_ptr->slabs = slab;
+    pool_ptr->num_slabs++;
+
+    char *objects = (char *)slab + header;
+    for (int i = pool_ptr->objects_per_slab - 1; i >= 0; i--)
+    {
+        pool_object *object = (pool_object *)(objects + i * pool_ptr->object_size);
+        object->next = (pool_object *)pool_ptr->free_list;
+        pool_ptr->free_list = object;
+    }
+    return 0;
+}
+
+/*
+ * Returns an object from the pool. Must only be called by the owner thread.
+ */
+void *pool_alloc(pool *pool_ptr)
+{
+    if (pool_ptr->free_list == NULL)
+    {
+        // take over everything other threads have returned in one step.
+        // The owner is the only consumer, so the exchange is free of ABA problems.
+        pool_ptr->free_list = __atomic_exchange_n(&pool_ptr->remote_free, NULL, __ATOMIC_ACQUIRE);
+    }
+    if (pool_ptr->free_list == NULL && pool_grow(pool_ptr) < 0)
+    {
+        return NULL;
+    }
+
+    pool_object *object = (pool_object *)pool_ptr->free_list;
+    pool_ptr->free_list = object->next;
+    return object;
+}
+
+/*
+ * Returns an object to the pool. Safe to call from any thread.
+ */
+void pool_free(pool *pool_ptr, void *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+
+    pool_object *node = (pool_object *)object;
+    pool_object *head = __atomic_load_n((pool_object **)&pool_ptr->remote_free, __ATOMIC_RELAXED);
+    do
+    {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n((pool_object **)&pool_ptr->remote_free, &head, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void pool_destroy(pool *pool_ptr)
+{
+    if (pool_ptr == NULL)
+    {
+        return;
+    }
+
+    pool_slab *slab = (pool_slab *)pool_ptr->slabs;
+    while (slab != NULL)
+    {
+        pool_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    free(pool_ptr);
+}
+
+arena *arena_create(size_t size)
+{
+    arena *arena_ptr = (arena *)malloc(sizeof(arena));
+
+    if (arena_ptr == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to arena.\n");
+        return NULL;
+    }
+
+    arena_ptr->size = ALIGN_UP(size, POOL_ALIGNMENT);
+    arena_ptr->buffer = (char *)malloc(arena_ptr->size);
+    if (arena_ptr->buffer == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to arena buffer.\n");
+        free(arena_ptr);
+        return NULL;
+    }
+    arena_ptr->used = 0;
+    arena_ptr->large = NULL;
+    return arena_ptr;
+}
+
+void *arena_alloc(arena *arena_ptr, size_t size)
+{
+    size = ALIGN_UP(size, POOL_ALIGNMENT);
+    if (arena_ptr->used + size <= arena_ptr->size)
+    {
+        void *ptr = arena_ptr->buffer + arena_ptr->used;
+        arena_ptr->used += size;
+        return ptr;
+    }
+
+    // too big for what is left of the buffer. Fall back to the heap until the next reset
+    size_t header = ALIGN_UP(sizeof(arena_chunk), POOL_ALIGNMENT);
+    arena_chunk *chunk = (arena_chunk *)malloc(header + size);
+    if (chunk == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to arena chunk.\n");
+        return NULL;
+    }
+    chunk->next = arena_ptr->large;
+    arena_ptr->large = chunk;
+    return (char *)chunk + header;
+}
+
+void arena_reset(arena *arena_ptr)
+{
+    arena_chunk *chunk = arena_ptr->large;
+    while (chunk != NULL)
+    {
+        arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_ptr->large = NULL;
+    arena_ptr->used = 0;
+}
+
+void arena_destroy(arena *arena_ptr)
+{
+    if (arena_ptr == NULL)
+    {
+        return;
+    }
+    arena_reset(arena_ptr);
+    free(arena_ptr->buffer);
+    free(arena_ptr);
+}
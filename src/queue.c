@@ -16,7 +16,11 @@ queues *queue_create()
     queue->head = NULL;
     queue->tail = NULL;
     queue->size = 0;
+    queue->max_size = 0;
+    queue->num_enqueued = 0;
+    queue->free_nodes = NULL;
     queue->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    queue->mutex_stats = (lock_stats){0, 0, 0, 0, 0};
     queue->condition_var = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
     return queue;
 }
@@ -51,7 +55,13 @@ void enqueue_critical_section(queues *queue, queue_node *node)
         queue->tail->next = node;
         queue->tail = node;
     }
-    queue->size += 1;
+    // the statistics are read without the lock, by the metrics route
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->num_enqueued, queue->num_enqueued + 1, __ATOMIC_RELAXED);
+    if (queue->size > queue->max_size)
+    {
+        __atomic_store_n(&queue->max_size, queue->size, __ATOMIC_RELAXED);
+    }
 }
 
 void *enqueue(queues *queue, void *data)
@@ -61,16 +71,29 @@ void *enqueue(queues *queue, void *data)
         return NULL;
     }
 
-    queue_node *node = queue_create_node(data);
+    lockstat_lock(&queue->mutex, &queue->mutex_stats);
+    // recycle a node released by dequeue. The queue lock already guards the free list
+    queue_node *node = queue->free_nodes;
+    if (node != NULL)
+    {
+        queue->free_nodes = node->next;
+        node->data = data;
+        node->next = NULL;
+        node->prev = NULL;
+    }
+    else
+    {
+        node = queue_create_node(data);
+    }
 
     if (node == NULL)
     {
+        lockstat_unlock(&queue->mutex, &queue->mutex_stats);
         fprintf(stderr, "Error while creating new node.\n");
         return NULL;
     }
-    pthread_mutex_lock(&queue->mutex);
     enqueue_critical_section(queue, node);
-    pthread_mutex_unlock(&queue->mutex);
+    lockstat_unlock(&queue->mutex, &queue->mutex_stats);
     return data;
 }
 
@@ -93,7 +116,7 @@ queue_node *dequeue_critical_section(queues *queue)
         queue->head = node->next;
         queue->head->prev = NULL;
     }
-    queue->size -= 1;
+    __atomic_store_n(&queue->size, queue->size - 1, __ATOMIC_RELAXED);
     return node;
 }
 
@@ -105,19 +128,17 @@ void *dequeue(queues *queue)
     }
 
     void *data = NULL;
-    pthread_mutex_lock(&queue->mutex);
+    lockstat_lock(&queue->mutex, &queue->mutex_stats);
     queue_node *node = dequeue_critical_section(queue);
-    pthread_mutex_unlock(&queue->mutex);
-    if (node == NULL)
+    if (node != NULL)
     {
-        return NULL;
+        data = node->data;
+        node->data = NULL;
+        node->prev = NULL;
+        node->next = queue->free_nodes;
+        queue->free_nodes = node;
     }
-
-    data = node->data;
-    node->prev = NULL;
-    node->next = NULL;
-    free(node);
-    node = NULL;
+    lockstat_unlock(&queue->mutex, &queue->mutex_stats);
     return data;
 }
 
@@ -136,6 +157,13 @@ void queue_destroy(queues *queue)
         free(temp);
         temp = NULL;
     }
+    node = queue->free_nodes;
+    while (node != NULL)
+    {
+        temp = node;
+        node = node->next;
+        free(temp);
+    }
     node = NULL;
     free(queue);
     queue = NULL;
@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "routes.h"
+#include "hash.h"
+
+#define ROUTE_MPH_LOAD 4         // average number of keys per displacement bucket
+#define ROUTE_MPH_MAX_SEEDS 64   // number of seeds tried before giving up on the perfect hash
+#define ROUTE_MPH_MAX_TRIES (1 << 20)
 
 route_map *route_create()
 {
@@ -12,8 +17,13 @@ route_map *route_create()
         return NULL;
     }
 
+    memset(map, 0, sizeof(route_map));
     map->map = NULL;
     map->num_routes = 0;
+    map->mounts = NULL;
+    map->num_mounts = 0;
+    map->max_mount_len = 0;
+    map->frozen = 0;
     return map;
 }
 
@@ -25,23 +35,59 @@ route_node *create_node(const char *key, const char *value, char **methods, size
     {
         return NULL;
     }
+    node->stats = (route_stats *)calloc(1, sizeof(route_stats));
+    if (node->stats == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to route statistics.\n");
+        free(node);
+        return NULL;
+    }
 
     if (key == NULL)
     {
         fprintf(stderr, "key is a required argument for registering a route.\n");
+        free(node->stats);
         free(node);
         return NULL;
     }
 
     node->key = key;
+    node->key_len = strlen(key);
     node->value = value;
     node->left = NULL;
     node->right = NULL;
     node->route_dir = route_dir;
     node->route_fn = route_fn;
+    node->request_fn = NULL;
     node->fn_args = fn_args;
     node->methods = methods;
     node->num_methods = num_methods;
+    node->method_mask = 0;
+    node->is_mount = 0;
+    node->mount_flags = 0;
+    node->cache_policy.header[0] = '\0';
+    node->owned_key = NULL;
+    node->owned_dir = NULL;
+
+    // resolve the method names once, so requests only test a bit
+    int offset = snprintf(node->allow_header, ROUTE_ALLOW_HEADER_SIZE, "Allow:");
+    for (size_t i = 0; i < num_methods; i++)
+    {
+        http_method method = http_method_parse(methods[i], strlen(methods[i]));
+        if (method == HTTP_METHOD_UNKNOWN)
+        {
+            fprintf(stderr, "WARN: Unknown method %s for route %s. Hence ignored.\n", methods[i], key);
+            continue;
+        }
+        if (node->method_mask & HTTP_METHOD_BIT(method))
+        {
+            continue;
+        }
+        node->method_mask |= HTTP_METHOD_BIT(method);
+        offset += snprintf(
+            node->allow_header + offset, ROUTE_ALLOW_HEADER_SIZE - offset,
+            "%s %s", node->method_mask == HTTP_METHOD_BIT(method) ? "" : ",", http_method_name(method));
+    }
     return node;
 }
 
@@ -70,6 +116,8 @@ route_node *register_route_handler(route_node *root, const char *key, const char
 
 void register_route(route_map *map, const char *key, const char *value, char **methods, size_t num_methods, const char *route_dir, void (*route_fn)(void *server, int new_socket_fd, const char *path, void *args), void *fn_args)
 {
+    // the frozen table no longer reflects the routes. Fall back to the BST until frozen again
+    route_thaw(map);
     route_node *root = map->map;
     if (root == NULL)
     {
@@ -82,30 +130,466 @@ void register_route(route_map *map, const char *key, const char *value, char **m
     map->num_routes += 1;
 }
 
-route_node *search_handler(route_node *root, const char *key)
+/*
+ * Compares a length delimited key against a node key.
+ * Orders keys the same way strcmp() does, so the BST can be searched without NUL terminators.
+ */
+int route_key_cmp(const char *key, size_t key_len, route_node *node)
+{
+    size_t n = key_len < node->key_len ? key_len : node->key_len;
+    int diff = memcmp(key, node->key, n);
+    if (diff)
+        return diff;
+    return key_len == node->key_len ? 0 : (key_len < node->key_len ? -1 : 1);
+}
+
+route_node *search_handler(route_node *root, const char *key, size_t key_len)
 {
     if (root == NULL)
     {
         return NULL;
     }
 
-    if (strcmp(key, root->key) == 0)
+    int diff = route_key_cmp(key, key_len, root);
+    if (diff == 0)
     {
         return root;
     }
-    else if (strcmp(key, root->key) < 0)
+    else if (diff < 0)
     {
-        return search_handler(root->left, key);
+        return search_handler(root->left, key, key_len);
     }
     else
     {
-        return search_handler(root->right, key);
+        return search_handler(root->right, key, key_len);
+    }
+}
+
+route_node *insert_node_handler(route_node *root, route_node *node)
+{
+    if (root == NULL)
+    {
+        return node;
+    }
+
+    int diff = route_key_cmp(node->key, node->key_len, root);
+    if (diff < 0)
+    {
+        root->left = insert_node_handler(root->left, node);
+    }
+    else if (diff > 0)
+    {
+        root->right = insert_node_handler(root->right, node);
+    }
+    return root;
+}
+
+/*
+ * Registers a route whose handler receives the parsed request.
+ */
+void register_route_request(route_map *map, const char *key, char **methods, size_t num_methods, const char *route_dir, void (*request_fn)(void *server, int new_socket_fd, http_request *request, const char *path, void *args), void *fn_args)
+{
+    if (key == NULL)
+    {
+        fprintf(stderr, "key is a required argument for registering a route.\n");
+        return;
+    }
+    route_node *existing = search_handler(map->map, key, strlen(key));
+    register_route(map, key, NULL, methods, num_methods, route_dir, NULL, fn_args);
+    route_node *node = search_handler(map->map, key, strlen(key));
+    if (node != NULL && node != existing)
+    {
+        node->request_fn = request_fn;
     }
 }
 
 route_node *route_search(route_map *map, const char *key)
 {
-    return search_handler(map->map, key);
+    return route_lookup(map, key, strlen(key));
+}
+
+static inline uint32_t route_slot_index(route_hash *table, uint64_t hash)
+{
+    // a single hash provides the bucket and both displacement functions
+    uint32_t bucket = (uint32_t)((hash >> 40) % table->num_buckets);
+    uint64_t f1 = (hash & 0xfffff) % table->num_slots;
+    uint64_t f2 = ((hash >> 20) & 0xfffff) % table->num_slots;
+    uint64_t d0 = table->displacements[2 * bucket];
+    uint64_t d1 = table->displacements[2 * bucket + 1];
+    return (uint32_t)((f1 + d0 * f2 + d1) % table->num_slots);
+}
+
+static inline route_node *route_hash_get(route_hash *table, const char *key, size_t key_len)
+{
+    if (table->num_slots == 0)
+    {
+        return NULL;
+    }
+    route_slot *slot = &table->slots[route_slot_index(table, hash64(key, key_len, table->seed))];
+    if (slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0)
+    {
+        return slot->node;
+    }
+    return NULL;
+}
+
+/*
+ * Looks up a route by its exact key.
+ * Once the map is frozen, this costs one hash and one key comparison.
+ */
+route_node *route_lookup(route_map *map, const char *key, size_t key_len)
+{
+    if (!map->frozen)
+    {
+        return search_handler(map->map, key, key_len);
+    }
+    return route_hash_get(&map->routes_hash, key, key_len);
+}
+
+/*
+ * Finds the mount with the longest prefix of path.
+ * Prefixes only match whole path segments, so the frozen mount table is probed
+ * at each '/' boundary within the longest mount prefix, longest first.
+ * The root mount has the empty prefix and matches every path.
+ */
+route_node *route_match_mount(route_map *map, const char *path, size_t path_len)
+{
+    if (map->num_mounts == 0)
+    {
+        return NULL;
+    }
+
+    size_t end = path_len < map->max_mount_len ? path_len : map->max_mount_len;
+    if (end < path_len)
+    {
+        // only a segment boundary can end a mount prefix
+        while (end > 0 && path[end] != '/')
+            end--;
+    }
+
+    for (;;)
+    {
+        route_node *node = map->frozen ? route_hash_get(&map->mounts_hash, path, end) : search_handler(map->mounts, path, end);
+        if (node)
+        {
+            return node;
+        }
+        if (end == 0)
+        {
+            return NULL;
+        }
+        do
+        {
+            end--;
+        } while (end > 0 && path[end] != '/');
+    }
+}
+
+int collect_route_nodes(route_node *root, route_node **nodes, int index)
+{
+    if (root == NULL)
+    {
+        return index;
+    }
+    index = collect_route_nodes(root->left, nodes, index);
+    nodes[index++] = root;
+    return collect_route_nodes(root->right, nodes, index);
+}
+
+int count_route_nodes(route_node *root)
+{
+    if (root == NULL)
+    {
+        return 0;
+    }
+    return 1 + count_route_nodes(root->left) + count_route_nodes(root->right);
+}
+
+struct mph_bucket
+{
+    uint32_t id;
+    int size;
+    int start;
+};
+
+int mph_bucket_cmp(const void *a, const void *b)
+{
+    const struct mph_bucket *A = (const struct mph_bucket *)a;
+    const struct mph_bucket *B = (const struct mph_bucket *)b;
+    if (A->size != B->size)
+    {
+        return B->size - A->size;
+    }
+    return (int)A->id - (int)B->id;
+}
+
+/*
+ * Tries to place every key with the given seed (hash and displace).
+ * Buckets are placed largest first, each searching for a displacement pair
+ * (d0, d1) that maps all of its keys to free slots.
+ * Returns 1 on success, 0 if the seed does not yield a perfect hash.
+ */
+int route_mph_place(route_hash *map, route_node **nodes, int n, uint64_t seed, uint64_t *hashes, int *order, struct mph_bucket *buckets, char *taken, uint32_t *slot_of)
+{
+    int nb = map->num_buckets;
+
+    for (int b = 0; b < nb; b++)
+    {
+        buckets[b].id = b;
+        buckets[b].size = 0;
+        buckets[b].start = 0;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        hashes[i] = hash64(nodes[i]->key, nodes[i]->key_len, seed);
+        buckets[(hashes[i] >> 40) % nb].size++;
+    }
+    // bucket the keys by their first level hash
+    int start = 0;
+    for (int b = 0; b < nb; b++)
+    {
+        buckets[b].start = start;
+        start += buckets[b].size;
+        buckets[b].size = 0;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        struct mph_bucket *bucket = &buckets[(hashes[i] >> 40) % nb];
+        order[bucket->start + bucket->size++] = i;
+    }
+    qsort(buckets, nb, sizeof(struct mph_bucket), mph_bucket_cmp);
+    for (int i = 0; i < n; i++)
+    {
+        taken[i] = 0;
+    }
+
+    map->seed = seed;
+    for (int b = 0; b < nb && buckets[b].size > 0; b++)
+    {
+        struct mph_bucket *bucket = &buckets[b];
+        long max_tries = (long)n * n < ROUTE_MPH_MAX_TRIES ? (long)n * n : ROUTE_MPH_MAX_TRIES;
+        int placed = 0;
+
+        for (long t = 0; t < max_tries && !placed; t++)
+        {
+            map->displacements[2 * bucket->id] = (uint32_t)(t / n);
+            map->displacements[2 * bucket->id + 1] = (uint32_t)(t % n);
+
+            int k;
+            for (k = 0; k < bucket->size; k++)
+            {
+                uint32_t slot = route_slot_index(map, hashes[order[bucket->start + k]]);
+                if (taken[slot])
+                {
+                    break;
+                }
+                taken[slot] = 1;
+                slot_of[k] = slot;
+            }
+            if (k == bucket->size)
+            {
+                placed = 1;
+                for (k = 0; k < bucket->size; k++)
+                {
+                    map->slots[slot_of[k]].node = nodes[order[bucket->start + k]];
+                }
+            }
+            else
+            {
+                // undo the partial placement of this bucket
+                while (k-- > 0)
+                {
+                    taken[slot_of[k]] = 0;
+                }
+            }
+        }
+
+        if (!placed)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Builds a minimal perfect hash over the keys of the given BST.
+ * Returns the number of keys in the table or -1 on failure.
+ */
+int route_hash_build(route_hash *map, route_node *root)
+{
+    memset(map, 0, sizeof(route_hash));
+
+    int n = count_route_nodes(root);
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    route_node **nodes = (route_node **)malloc(sizeof(route_node *) * n);
+    uint64_t *hashes = (uint64_t *)malloc(sizeof(uint64_t) * n);
+    int *order = (int *)malloc(sizeof(int) * n);
+    char *taken = (char *)malloc(n);
+    uint32_t *slot_of = (uint32_t *)malloc(sizeof(uint32_t) * n);
+
+    map->num_slots = n;
+    map->num_buckets = n / ROUTE_MPH_LOAD + 1;
+    map->slots = (route_slot *)calloc(n, sizeof(route_slot));
+    map->displacements = (uint32_t *)calloc(2 * map->num_buckets, sizeof(uint32_t));
+    struct mph_bucket *buckets = (struct mph_bucket *)malloc(sizeof(struct mph_bucket) * map->num_buckets);
+
+    int frozen = 0;
+    if (nodes && hashes && order && taken && slot_of && map->slots && map->displacements && buckets)
+    {
+        collect_route_nodes(root, nodes, 0);
+        for (uint64_t seed = 0; seed < ROUTE_MPH_MAX_SEEDS && !frozen; seed++)
+        {
+            memset(map->displacements, 0, sizeof(uint32_t) * 2 * map->num_buckets);
+            frozen = route_mph_place(map, nodes, n, seed, hashes, order, buckets, taken, slot_of);
+        }
+    }
+
+    free(nodes);
+    free(hashes);
+    free(order);
+    free(taken);
+    free(slot_of);
+    free(buckets);
+
+    if (!frozen)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        map->slots[i].key = map->slots[i].node->key;
+        map->slots[i].key_len = map->slots[i].node->key_len;
+    }
+    return n;
+}
+
+void route_hash_free(route_hash *map)
+{
+    if (map->slots)
+        free(map->slots);
+    if (map->displacements)
+        free(map->displacements);
+    memset(map, 0, sizeof(route_hash));
+}
+
+/*
+ * Compiles the registered routes and mounts into immutable minimal perfect hashes.
+ * Returns the number of routes in the frozen table or -1 on failure, in which
+ * case lookups keep using the BSTs.
+ */
+int route_freeze(route_map *map)
+{
+    if (map == NULL)
+    {
+        return -1;
+    }
+    route_thaw(map);
+
+    int n = route_hash_build(&map->routes_hash, map->map);
+    if (n < 0 || route_hash_build(&map->mounts_hash, map->mounts) < 0)
+    {
+        fprintf(stderr, "WARN: Could not build a perfect hash over the routes. Using the route BST.\n");
+        route_thaw(map);
+        return -1;
+    }
+    map->frozen = 1;
+    return n;
+}
+
+/*
+ * Drops the frozen tables. Lookups go back to the BSTs.
+ */
+void route_thaw(route_map *map)
+{
+    route_hash_free(&map->routes_hash);
+    route_hash_free(&map->mounts_hash);
+    map->frozen = 0;
+}
+
+/*
+ * Returns the mount registered with prefix, or NULL. Trailing slashes are ignored.
+ */
+route_node *route_find_mount(route_map *map, const char *prefix)
+{
+    if (prefix == NULL || prefix[0] != '/')
+        return NULL;
+    size_t prefix_len = strlen(prefix);
+    while (prefix_len > 0 && prefix[prefix_len - 1] == '/')
+        prefix_len--;
+    return search_handler(map->mounts, prefix, prefix_len);
+}
+
+/*
+ * Registers a static file mount. Requests under prefix are served from dir.
+ * Both are copied. Trailing slashes are ignored, so "/" mounts the root.
+ */
+void register_mount(route_map *map, const char *prefix, const char *dir, int flags)
+{
+    static char *mount_methods[2] = {"GET", "HEAD"};
+
+    if (prefix == NULL || prefix[0] != '/')
+    {
+        fprintf(stderr, "Mount prefix must start with '/'.\n");
+        return;
+    }
+    route_thaw(map);
+
+    size_t prefix_len = strlen(prefix);
+    while (prefix_len > 0 && prefix[prefix_len - 1] == '/')
+        prefix_len--;
+    if (dir == NULL)
+        dir = "";
+    while (*dir == '/')
+        dir++;
+    size_t dir_len = strlen(dir);
+    while (dir_len > 0 && dir[dir_len - 1] == '/')
+        dir_len--;
+
+    char *key = (char *)malloc(prefix_len + 1);
+    char *mount_dir = (char *)malloc(dir_len + 1);
+    if (key == NULL || mount_dir == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to mount %s.\n", prefix);
+        free(key);
+        free(mount_dir);
+        return;
+    }
+    sprintf(key, "%.*s", (int)prefix_len, prefix);
+    sprintf(mount_dir, "%.*s", (int)dir_len, dir);
+
+    if (search_handler(map->mounts, key, prefix_len) != NULL)
+    {
+        fprintf(stderr, "WARN: Mount %s already exists! Hence ignored.\n", prefix);
+        free(key);
+        free(mount_dir);
+        return;
+    }
+
+    route_node *node = create_node(key, NULL, mount_methods, 2, mount_dir, NULL, NULL);
+    if (node == NULL)
+    {
+        free(key);
+        free(mount_dir);
+        return;
+    }
+    node->is_mount = 1;
+    node->mount_flags = flags;
+    node->owned_key = key;
+    node->owned_dir = mount_dir;
+
+    map->mounts = insert_node_handler(map->mounts, node);
+    map->num_mounts += 1;
+    if (prefix_len > map->max_mount_len)
+    {
+        map->max_mount_len = prefix_len;
+    }
+    fprintf(stdout, "Added Mount - %s with directory /%s\n", prefix, mount_dir);
 }
 
 /*
@@ -147,12 +631,18 @@ route_node *delete_handler(route_node *node, route_node *parent, const char *key
 
 void free_route_node(route_node *node)
 {
+    if (node->owned_key)
+        free(node->owned_key);
+    if (node->owned_dir)
+        free(node->owned_dir);
+    free(node->stats);
     free(node);
     node = NULL;
 }
 
 void *route_delete(route_map *map, const char *key)
 {
+    route_thaw(map);
     route_node *delNode = delete_handler(map->map, NULL, key);
     if (delNode == NULL)
     {
@@ -190,6 +680,24 @@ void route_inorder_traversal(route_map *map)
     inorder_traversal_handler(map->map);
 }
 
+static void foreach_handler(route_node *root, void (*fn)(route_node *node, void *arg), void *arg)
+{
+    if (root == NULL)
+    {
+        return;
+    }
+    foreach_handler(root->left, fn, arg);
+    fn(root, arg);
+    foreach_handler(root->right, fn, arg);
+}
+
+/* Calls fn on every route in key order, then on every mount. */
+void route_foreach(route_map *map, void (*fn)(route_node *node, void *arg), void *arg)
+{
+    foreach_handler(map->map, fn, arg);
+    foreach_handler(map->mounts, fn, arg);
+}
+
 void destroy_route_handler(route_node *root)
 {
     if (root == NULL)
@@ -205,8 +713,11 @@ void destroy_route_handler(route_node *root)
 
 void route_destroy(route_map *map)
 {
+    route_thaw(map);
     destroy_route_handler(map->map);
+    destroy_route_handler(map->mounts);
     map->map = NULL;
+    map->mounts = NULL;
     free(map);
     map = NULL;
 }
@@ -230,15 +741,7 @@ void route_node_print(route_node *node)
         fprintf(stdout, "Route Directory: %s\n", node->route_dir);
 }
 
-int route_check_method(route_node *node, char *method)
+int route_check_method(route_node *node, http_method method)
 {
-    int return_value = 0;
-    for (int i = 0; i < node->num_methods; i++)
-    {
-        if (strcmp(node->methods[i], method) == 0)
-        {
-            return_value = 1;
-        }
-    }
-    return return_value;
+    return (node->method_mask & HTTP_METHOD_BIT(method)) != 0;
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
@@ -7,6 +9,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -23,6 +27,10 @@
 #include "server.h"
 #include "picohttpparser.h"
 #include "queues.h"
+#include "http.h"
+#include "hash.h"
+#include "log.h"
+#include "pool.h"
 
 #define DEFAULT_PORT "8080"
 #define DEFAULT_MAX_RESPONSE_SIZE 64 * 1024 * 1024 // 64 MB
@@ -31,6 +39,20 @@
 #define DEFAULT_BACKLOG 10
 #define DEFAULT_THREAD_POOL_SIZE 12
 #define DEFAULT_BLOCK_DIM 2
+#define REQUEST_BUFFER_SIZE 4096
+#define REQUEST_ARENA_SIZE 16 * 1024
+#define PAYLOAD_POOL_SLAB_SIZE 256
+#define DEFAULT_ZEROCOPY_THRESHOLD 128 * 1024 // 128 KB
+#define REQUEST_TIMEOUT 10000                  // ms a client may take to send its request
+
+// output queue of the connection the calling worker is responding on
+static __thread output_queue *current_output = NULL;
+// HTTP minor version of the request the calling worker is responding to
+static __thread int current_minor_version = 1;
+// bytes sent or queued for the request the calling worker is responding to
+static __thread long current_bytes_sent = 0;
+// status code of the response the calling worker sent, 0 before the status line
+static __thread int current_status = 0;
 
 volatile sig_atomic_t status;
 
@@ -59,6 +81,21 @@ double get_time_difference(struct timespec *start, struct timespec *end)
     return tdiff;
 }
 
+uint64_t elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000UL + end->tv_nsec - start->tv_nsec;
+}
+
+// takes the status code from a status line such as "HTTP/1.1 200 OK"
+static inline void note_status(const char *header)
+{
+    const char *code = strchr(header, ' ');
+    if (code != NULL)
+    {
+        current_status = atoi(code + 1);
+    }
+}
+
 void calculate_size(long bytes, long *arr)
 {
     long gbs, mbs, kbs;
@@ -84,6 +121,223 @@ void server_route(http_server *server, const char *key, const char *value, char
     register_route(server->route_table, key, value, methods, method_len, route_dir, route_fn, fn_args);
 }
 
+/*
+ * Registers a route handled by request_fn, which receives the parsed request
+ * along with the path of route_dir inside the server root.
+ */
+void server_route_request(http_server *server, const char *key, char **methods, size_t method_len, const char *route_dir, void (*request_fn)(void *, int, http_request *, const char *, void *), void *fn_args)
+{
+    if (server == NULL)
+    {
+        fprintf(stderr, "Server object not created.\n");
+        return;
+    }
+    register_route_request(server->route_table, key, methods, method_len, route_dir, request_fn, fn_args);
+}
+
+/*
+ * Serves the files in dir (relative to the server root) under the URL prefix.
+ * flags selects the cache policy of the mount: MOUNT_CACHE or MOUNT_NO_CACHE.
+ */
+void server_mount(http_server *server, const char *prefix, const char *dir, int flags)
+{
+    if (server == NULL)
+    {
+        fprintf(stderr, "Server object not created.\n");
+        return;
+    }
+    register_mount(server->route_table, prefix, dir, flags);
+}
+
+/*
+ * Sets the Cache-Control policy of the files served from the mount at prefix,
+ * which must be registered already. flags are CACHE_POLICY_* bits.
+ * For "/" without any mount registered, the default mount of the server root
+ * is registered here instead of in server_start(), so it can take the policy.
+ */
+void server_mount_cache_control(http_server *server, const char *prefix, long max_age, int flags)
+{
+    if (server == NULL)
+    {
+        fprintf(stderr, "Server object not created.\n");
+        return;
+    }
+    route_node *mount = route_find_mount(server->route_table, prefix);
+    if (mount == NULL && prefix != NULL && prefix[0] == '/' && prefix[strspn(prefix, "/")] == '\0' &&
+        server->route_table->num_mounts == 0)
+    {
+        register_mount(server->route_table, "/", "", MOUNT_CACHE);
+        mount = route_find_mount(server->route_table, prefix);
+    }
+    if (mount == NULL)
+    {
+        fprintf(stderr, "[Server:%d] No mount at %s. Register the mount before its cache policy.\n", server->port, prefix);
+        return;
+    }
+    cache_policy policy;
+    if (cache_policy_init(&policy, max_age, flags) == 0)
+    {
+        mount->cache_policy = policy;
+    }
+}
+
+/*
+ * Sets the Cache-Control policy of static files with extension, e.g. ".css".
+ * It takes precedence over the policy of the mount the file is served from.
+ */
+void server_extension_cache_control(http_server *server, const char *extension, long max_age, int flags)
+{
+    if (server == NULL)
+    {
+        fprintf(stderr, "Server object not created.\n");
+        return;
+    }
+    if (cache_policy_map_set(server->cache_policies, extension, max_age, flags) < 0)
+    {
+        fprintf(stderr, "[Server:%d] Could not set the cache policy of %s files.\n", server->port, extension);
+    }
+}
+
+/*
+ * Selects where cached files are stored: CACHE_STORAGE_HEAP (the default) or
+ * CACHE_STORAGE_MEMFD. Call it before server_start().
+ */
+void server_cache_storage(http_server *server, int storage)
+{
+    if (server == NULL)
+    {
+        fprintf(stderr, "Server object not created.\n");
+        return;
+    }
+    if (storage != CACHE_STORAGE_HEAP && storage != CACHE_STORAGE_MEMFD)
+    {
+        fprintf(stderr, "[Server:%d] Unknown cache storage %d.\n", server->port, storage);
+        return;
+    }
+    server->cache_storage = storage;
+}
+
+/*
+ * Cached files of at least threshold bytes are sent with MSG_ZEROCOPY, so
+ * many clients downloading the same large file do not each copy it into
+ * the kernel. Pass 0 to always copy. Call it before server_start().
+ */
+void server_zerocopy_threshold(http_server *server, size_t threshold)
+{
+    if (server == NULL)
+    {
+        fprintf(stderr, "Server object not created.\n");
+        return;
+    }
+    server->zerocopy_threshold = threshold;
+}
+
+/*
+ * Serves the statistics of the server at path, in the Prometheus text format.
+ * They are served at METRICS_DEFAULT_PATH unless this is called. Pass NULL to
+ * not serve them. Call it before server_start().
+ */
+void server_metrics(http_server *server, const char *path)
+{
+    free(server->metrics_path);
+    server->metrics_path = path ? strdup(path) : NULL;
+}
+
+/*
+ * Appends a binary record of every request to the file at path. Workers only
+ * queue the records; a background thread writes them. Pass NULL to not log.
+ * Call it before server_start().
+ */
+void server_access_log(http_server *server, const char *path)
+{
+    free(server->access_log_path);
+    server->access_log_path = path ? strdup(path) : NULL;
+}
+
+/*
+ * Records spans of one in sample_rate connections: accept, enqueue, dequeue,
+ * parse, route lookup, cache lookup, file load, handler and send. Each thread
+ * keeps the latest TRACE_BUFFER_SPANS spans. SIGUSR1 writes them to path in
+ * the Chrome trace event format. Pass 0 to not trace. Call it before server_start().
+ */
+void server_trace(http_server *server, int sample_rate, const char *path)
+{
+    free(server->trace_path);
+    server->trace_sample_rate = sample_rate > 0 && path != NULL ? sample_rate : 0;
+    server->trace_path = server->trace_sample_rate > 0 ? strdup(path) : NULL;
+}
+
+/*
+ * Returns the statistics of the route or mount registered at key, or NULL
+ * if there is none. They are updated while the server runs.
+ */
+const route_stats *server_route_stats(http_server *server, const char *key)
+{
+    route_node *node = route_search(server->route_table, key);
+    if (node == NULL)
+    {
+        node = route_find_mount(server->route_table, key);
+    }
+    return node ? node->stats : NULL;
+}
+
+/*
+ * Hashes every file below the server root, so that mounted files can also be
+ * requested by fingerprinted names such as main.<fingerprint>.css. Those never
+ * change under the same name and are served with a one year immutable policy.
+ * Call it once the files are in place, before server_start().
+ * Returns the number of files fingerprinted, or -1 on error.
+ */
+int server_fingerprint_assets(http_server *server)
+{
+    if (server == NULL)
+    {
+        fprintf(stderr, "Server object not created.\n");
+        return -1;
+    }
+    asset_map *assets = asset_map_create(server->server_root_dir);
+    if (assets == NULL)
+    {
+        fprintf(stderr, "[Server:%d] Could not fingerprint the files in %s.\n", server->port, server->server_root_dir);
+        return -1;
+    }
+    asset_map_destroy(server->assets);
+    server->assets = assets;
+    return assets->num_assets;
+}
+
+/*
+ * Writes the fingerprinted form of url, the path of a file served from a mount,
+ * to buffer. Returns buffer, or url itself if the file has no fingerprint.
+ */
+const char *server_asset_url(http_server *server, const char *url, char *buffer, size_t size)
+{
+    if (server == NULL || server->assets == NULL)
+    {
+        return url;
+    }
+    size_t url_len = strlen(url);
+    route_node *mount = route_match_mount(server->route_table, url, url_len);
+    if (mount == NULL)
+    {
+        return url;
+    }
+
+    char file[4096];
+    snprintf(file, sizeof(file), "%s%s", mount->route_dir, url + mount->key_len);
+    char *relative = file;
+    while (*relative == '/')
+    {
+        relative++;
+    }
+    const char *fingerprint = asset_fingerprint(server->assets, relative);
+    if (fingerprint == NULL || asset_fingerprint_name(url, fingerprint, buffer, size) == 0)
+    {
+        return url;
+    }
+    return buffer;
+}
+
 cache_node *server_cache_resource_handler(http_server *server, char *key, char *content_type, void *data, size_t content_length)
 {
     if (key == NULL || data == NULL)
@@ -117,7 +371,7 @@ cache_node *server_cache_retreive_handler(http_server *server, char *key)
     cache_node *node = cache_get(server->cache, key);
     if (node == NULL)
     {
-        fprintf(stderr, "[Server:%d] Key=%s not present in cache.\n", server->port, key);
+        log_debug("[Server:%d] Key=%s not present in cache.\n", server->port, key);
         return NULL;
     }
     return node;
@@ -155,23 +409,23 @@ cache_node *server_cache_manager(http_server *server, int opcode, char *key, cha
             // replace with default content type
             content_type = "text/html";
         }
-        pthread_mutex_lock(&server->cache->mutex);
+        lockstat_lock(&server->cache->mutex, &server->cache->mutex_stats);
         node = server_cache_resource_handler(server, key, content_type, data, content_length);
         if (node)
         {
             server->server_logs->cache_miss += 1;
         }
-        pthread_mutex_unlock(&server->cache->mutex);
+        lockstat_unlock(&server->cache->mutex, &server->cache->mutex_stats);
         break;
     case 1:
         // retreive item from cache
-        pthread_mutex_lock(&server->cache->mutex);
+        lockstat_lock(&server->cache->mutex, &server->cache->mutex_stats);
         node = server_cache_retreive_handler(server, key);
         if (node)
         {
             server->server_logs->cache_hits += 1;
         }
-        pthread_mutex_unlock(&server->cache->mutex);
+        lockstat_unlock(&server->cache->mutex, &server->cache->mutex_stats);
         break;
     default:
         fprintf(stderr, "[Server:%d] Invalid opcode=%d", server->port, opcode);
@@ -200,14 +454,362 @@ cache_node *server_cache_retreive(http_server *server, char *key)
     return node;
 }
 
+// adds the bytes a send primitive reports to the current request and passes rv on
+static inline long count_sent(long rv)
+{
+    if (rv > 0)
+    {
+        current_bytes_sent += rv;
+    }
+    return rv;
+}
+
+/*
+ * Returns the output queue of the connection on new_socket_fd if the calling
+ * worker is responding on it, NULL otherwise.
+ */
+output_queue *connection_output(int new_socket_fd)
+{
+    return current_output != NULL && current_output->socket_fd == new_socket_fd ? current_output : NULL;
+}
+
+// waits until a non-blocking socket accepts more bytes. Returns 0, or -1 on timeout or error
+static int wait_writable(int new_socket_fd)
+{
+    struct pollfd pfd = {new_socket_fd, POLLOUT, 0};
+    return poll(&pfd, 1, OUTPUT_IDLE_TIMEOUT * 1000) > 0 ? 0 : -1;
+}
+
+// does the sending of sendmsg_all()
+static long send_iov(int new_socket_fd, struct iovec *iov, int iovcnt, int flags)
+{
+    output_queue *output = connection_output(new_socket_fd);
+    if (output != NULL)
+    {
+        return count_sent(output_writev(output, iov, iovcnt, flags, iovcnt, NULL, NULL));
+    }
+
+    long total = 0;
+    while (iovcnt > 0)
+    {
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        long rv = sendmsg(new_socket_fd, &msg, flags | MSG_NOSIGNAL);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(new_socket_fd) == 0)
+                continue;
+            log_warn("Could not send response: %s\n", strerror(errno));
+            return count_sent(total > 0 ? total : -1);
+        }
+        total += rv;
+        while (iovcnt > 0 && (size_t)rv >= iov->iov_len)
+        {
+            rv -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+    return count_sent(total);
+}
+
+/*
+ * Sends all of iov with sendmsg flags, continuing after partial writes.
+ * MSG_MORE holds back a partial packet when a sendfile follows.
+ * On the connection of the calling worker, what the socket does not take
+ * right away is copied to its output queue instead of blocking the worker.
+ * Returns the number of bytes written or queued, or -1.
+ */
+long sendmsg_all(int new_socket_fd, struct iovec *iov, int iovcnt, int flags)
+{
+    uint64_t span = trace_begin();
+    long rv = send_iov(new_socket_fd, iov, iovcnt, flags);
+    trace_end(TRACE_SEND, span);
+    return rv;
+}
+
+// writes all of iov, continuing after partial writes. Returns the number of bytes written, or -1
+long writev_all(int new_socket_fd, struct iovec *iov, int iovcnt)
+{
+    return sendmsg_all(new_socket_fd, iov, iovcnt, 0);
+}
+
+// does the sending of sendfile_all()
+static long send_file_range(int new_socket_fd, int fd, size_t offset, size_t length)
+{
+    output_queue *output = connection_output(new_socket_fd);
+    if (output != NULL)
+    {
+        return count_sent(output_sendfile(output, fd, offset, length));
+    }
+
+    off_t file_offset = offset;
+    size_t sent = 0;
+    while (sent < length)
+    {
+        long rv = sendfile(new_socket_fd, fd, &file_offset, length - sent);
+        if (rv <= 0)
+        {
+            if (rv < 0 && errno == EINTR)
+                continue;
+            if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(new_socket_fd) == 0)
+                continue;
+            log_warn("Could not send response: %s\n", strerror(errno));
+            return count_sent(sent > 0 ? (long)sent : -1);
+        }
+        sent += rv;
+    }
+    return count_sent(sent);
+}
+
+/*
+ * Sends length bytes of fd from offset. Like sendmsg_all(), the rest is
+ * queued on the connection of the calling worker when the socket is full.
+ */
+long sendfile_all(int new_socket_fd, int fd, size_t offset, size_t length)
+{
+    uint64_t span = trace_begin();
+    long rv = send_file_range(new_socket_fd, fd, offset, length);
+    trace_end(TRACE_SEND, span);
+    return rv;
+}
+
 int send_http_response(http_server *server, int new_socket_fd, char *header, char *content_type, char *body, size_t content_length)
 {
-    const long max_response_size = server->max_response_size;
-    // char *response = (char *)malloc(sizeof(char) * 4096);
+    return send_http_response_headers(server, new_socket_fd, header, content_type, NULL, body, content_length);
+}
+
+/*
+ * Writes the status line and headers of a response into buffer.
+ * Returns the length written, or -1 if they do not fit.
+ */
+long format_response_headers(char *buffer, size_t size, const char *header, const char *content_type, const char *extra_headers, size_t content_length)
+{
+    note_status(header);
+    long length = snprintf(
+        buffer, size,
+        "%s\n"
+        "Content-Length: %ld\n"
+        "Content-Type: %s\n"
+        "Connection: close\n"
+        "Date: %s\n"
+        "%s"
+        "\n",
+        header, (long)content_length, content_type, http_date_now(), extra_headers ? extra_headers : "");
+    return length < (long)size ? length : -1;
+}
+
+/*
+ * Same as send_http_response(), with extra_headers placed after the standard headers.
+ * extra_headers holds complete header lines, each terminated by a newline, or NULL.
+ */
+int send_http_response_headers(http_server *server, int new_socket_fd, char *header, char *content_type, const char *extra_headers, char *body, size_t content_length)
+{
+    char response[4096];
+    long response_length = format_response_headers(response, sizeof(response), header, content_type, extra_headers, content_length);
+
+    if (response_length < 0)
+    {
+        log_error("[Server:%d] Response headers exceed %ld bytes.\n", server->port, (long)sizeof(response));
+        return -1;
+    }
+    struct iovec iov[2] = {{response, response_length}, {body, content_length}};
+    return writev_all(new_socket_fd, iov, 2);
+}
+
+/*
+ * Starts a streamed response by sending its status line and headers. The
+ * body follows with http_stream_write() and http_stream_printf(), and
+ * http_stream_end() finishes the response. stream is usually on the stack.
+ * Returns 0, or -1 if the headers could not be sent.
+ */
+int http_stream_begin(http_stream *stream, http_server *server, int new_socket_fd, char *header, char *content_type, const char *extra_headers)
+{
+    stream->server = server;
+    stream->socket_fd = new_socket_fd;
+    stream->chunked = current_minor_version >= 1;
+    stream->failed = 0;
+    stream->bytes_sent = 0;
+    stream->length = 0;
+    note_status(header);
+
     char response[4096];
+    long response_length = snprintf(
+        response, sizeof(response),
+        "%s\n"
+        "%s"
+        "Content-Type: %s\n"
+        "Connection: close\n"
+        "Date: %s\n"
+        "%s"
+        "\n",
+        header, stream->chunked ? "Transfer-Encoding: chunked\n" : "", content_type, http_date_now(), extra_headers ? extra_headers : "");
+    if (response_length >= (long)sizeof(response))
+    {
+        log_error("[Server:%d] Response headers exceed %ld bytes.\n", server->port, (long)sizeof(response));
+        stream->failed = 1;
+        return -1;
+    }
+    // the first chunk usually follows right away and shares the packet
+    long rv = sendmsg_all(new_socket_fd, (struct iovec[]){{response, response_length}}, 1, MSG_MORE);
+    if (rv < 0)
+    {
+        stream->failed = 1;
+        return -1;
+    }
+    stream->bytes_sent += rv;
+    return 0;
+}
+
+/*
+ * Holds the writer back while a slow client is more than
+ * HTTP_STREAM_MAX_QUEUED bytes behind, so the queued output stays bounded.
+ */
+static int http_stream_wait(http_stream *stream)
+{
+    output_queue *output = connection_output(stream->socket_fd);
+    while (output != NULL && output->queued_bytes > HTTP_STREAM_MAX_QUEUED)
+    {
+        int rv = output_flush(output);
+        if (rv < 0 || (rv == 0 && wait_writable(stream->socket_fd) < 0))
+        {
+            log_info("[Server:%d] Client stopped reading a streamed response.\n", stream->server->port);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// sends the buffered bytes followed by data as one chunk. Returns 0, or -1 once the client is gone
+static int http_stream_flush(http_stream *stream, const char *data, size_t length)
+{
+    size_t buffered = stream->length;
+    stream->length = 0;
+    if (stream->failed)
+    {
+        return -1;
+    }
+    if (buffered + length == 0)
+    {
+        return 0; // an empty chunk would end the body
+    }
+
+    char size_line[32];
+    int size_length = stream->chunked ? snprintf(size_line, sizeof(size_line), "%zx\r\n", buffered + length) : 0;
+    struct iovec iov[4] = {
+        {size_line, size_length},
+        {stream->buffer, buffered},
+        {(char *)data, length},
+        {"\r\n", stream->chunked ? 2 : 0}};
+    long rv = writev_all(stream->socket_fd, iov, 4);
+    if (rv < 0 || http_stream_wait(stream) < 0)
+    {
+        stream->failed = 1;
+        return -1;
+    }
+    stream->bytes_sent += rv;
+    return 0;
+}
+
+/*
+ * Appends length bytes of data to the body. Small writes are buffered and
+ * sent together; data that does not fit the buffer is sent right away.
+ * data may be reused once this returns.
+ * Returns 0, or -1 if the client is gone.
+ */
+int http_stream_write(http_stream *stream, const void *data, size_t length)
+{
+    if (stream->failed)
+    {
+        return -1;
+    }
+    if (stream->length + length <= sizeof(stream->buffer))
+    {
+        memcpy(stream->buffer + stream->length, data, length);
+        stream->length += length;
+        return 0;
+    }
+    return http_stream_flush(stream, (const char *)data, length);
+}
+
+/* Appends formatted text to the body, like printf. Returns 0, or -1 if the client is gone. */
+int http_stream_printf(http_stream *stream, const char *format, ...)
+{
+    if (stream->failed)
+    {
+        return -1;
+    }
+    va_list args;
+    size_t space = sizeof(stream->buffer) - stream->length;
+    va_start(args, format);
+    int length = vsnprintf(stream->buffer + stream->length, space, format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return -1;
+    }
+    if ((size_t)length < space)
+    {
+        stream->length += length;
+        return 0;
+    }
+
+    // the text did not fit behind the buffered bytes. Send those and format again
+    if (http_stream_flush(stream, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    char *text = (size_t)length < sizeof(stream->buffer) ? stream->buffer : (char *)malloc(length + 1);
+    if (text == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to streamed text.\n");
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(text, length + 1, format, args);
+    va_end(args);
+    if (text == stream->buffer)
+    {
+        stream->length = length;
+        return 0;
+    }
+    int rv = http_stream_flush(stream, text, length);
+    free(text);
+    return rv;
+}
+
+/*
+ * Sends what is still buffered and ends the body.
+ * Returns the number of bytes sent for the whole response, or -1 if the client is gone.
+ */
+long http_stream_end(http_stream *stream)
+{
+    if (http_stream_flush(stream, NULL, 0) == 0 && stream->chunked)
+    {
+        long rv = writev_all(stream->socket_fd, (struct iovec[]){{"0\r\n\r\n", 5}}, 1);
+        if (rv < 0)
+            stream->failed = 1;
+        else
+            stream->bytes_sent += rv;
+    }
+    return stream->failed ? -1 : stream->bytes_sent;
+}
+
+int send_stream_http_response(http_server *server, int new_socket_fd, char *header, char *content_type, int *fd_ptr, size_t content_length)
+{
+    const long max_response_size = 4096;
+    char *response = (char *)malloc(sizeof(char) * max_response_size);
     long response_length;
     long body_size = content_length;
-
+    int fd = *fd_ptr;
     sprintf(
         response,
         "%s\n"
@@ -216,190 +818,786 @@ int send_http_response(http_server *server, int new_socket_fd, char *header, cha
         "Connection: close\n"
         "\n",
         header, body_size, content_type);
+    note_status(header);
 
     response_length = strlen(response);
-    long rv_header = write(
-        new_socket_fd,
+
+    long rv = sendmsg_all(new_socket_fd, (struct iovec[]){{response, response_length}}, 1, MSG_MORE);
+    long bytes = rv < 0 ? 0 : sendfile_all(new_socket_fd, fd, 0, content_length);
+
+    // clean up response buffers
+    free(response);
+    response = NULL;
+    return rv < 0 ? -1 : rv + (bytes > 0 ? bytes : 0);
+}
+
+int send_image_response(http_server *server, int new_socket_fd, char *header, char *content_type, char *data, size_t content_length)
+{
+    const long max_response_size = server->max_response_size;
+    char *response = (char *)malloc(sizeof(char) * max_response_size);
+    long response_length, body_size;
+    body_size = content_length;
+
+    sprintf(
         response,
-        response_length);
+        "%s\n"
+        "Content-Length: %ld\n"
+        "Content-Type: %s\n"
+        "Connection: close\n"
+        "\n",
+        header, body_size, content_type);
+    note_status(header);
+
+    response_length = strlen(response);
+
+    long rv = writev_all(new_socket_fd, (struct iovec[]){{response, response_length}, {data, content_length}}, 2);
+
+    free(response);
+    response = NULL;
+    return rv;
+}
+
+int response_400(http_server *server, int new_socket_fd)
+{
+    char body[] = "<h1>400 Bad Request</h1>";
+    int bytes_sent = send_http_response(
+        server, new_socket_fd, HEADER_400, "text/html", body, strlen(body));
+    return bytes_sent;
+}
+
+int response_404(http_server *server, int new_socket_fd)
+{
+    char body[] = "<h1>404 Page Not Found</h1>";
+    char header[] = "HTTP/1.1 404 NOT FOUND";
+    char content_type[] = "text/html";
+    int bytes_sent = send_http_response(
+        server, new_socket_fd, header, content_type, body, strlen(body));
+    return bytes_sent;
+}
+
+int response_405(http_server *server, int new_socket_fd, route_node *route)
+{
+    char body[] = "<h1>405 Method Not Allowed</h1>";
+    char allow[ROUTE_ALLOW_HEADER_SIZE + 2];
+    sprintf(allow, "%s\n", route->allow_header);
+    int bytes_sent = send_http_response_headers(
+        server, new_socket_fd, HEADER_405, "text/html", allow, body, strlen(body));
+    return bytes_sent;
+}
+
+/*
+ * Answers a conditional request whose representation the client already holds.
+ * A 304 carries the validators in extra_headers but no body, and no Content-Length.
+ */
+int response_304(http_server *server, int new_socket_fd, const char *extra_headers)
+{
+    char response[1024];
+    int response_length = snprintf(
+        response, sizeof(response),
+        "%s\n"
+        "%s"
+        "Connection: close\n"
+        "Date: %s\n"
+        "\n",
+        HEADER_304, extra_headers, http_date_now());
+    note_status(HEADER_304);
+    return writev_all(new_socket_fd, (struct iovec[]){{response, response_length}}, 1);
+}
+
+int file_response_handler(http_server *server, int new_socket_fd, char *path)
+{
+    return file_response(server, new_socket_fd, NULL, path, 1, cache_policy_map_get(server->cache_policies, path));
+}
+
+/*
+ * Writes the headers of a full response for the cached node, as stored in
+ * front of its content: everything but the blank line and the headers that
+ * differ between requests. encoding is the Content-Encoding of the content.
+ * Returns the length written, or -1 if they do not fit.
+ */
+long format_cached_headers(char *buffer, size_t size, cache_node *node, int encoding)
+{
+    char content_encoding[64] = "";
+    if (encoding != 0)
+    {
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\n", http_encoding_name(encoding));
+    }
+    long length = snprintf(
+        buffer, size,
+        "%s\n"
+        "Content-Length: %d\n"
+        "Content-Type: %s\n"
+        "Connection: close\n"
+        "ETag: %s\n"
+        "Last-Modified: %s\n"
+        "%s"
+        "Accept-Ranges: bytes\n"
+        "%s",
+        HEADER_OK, node->content_length, node->content_type, node->etag, node->last_modified_date,
+        mime_type_compressible(node->content_type) ? "Vary: Accept-Encoding\n" : "", content_encoding);
+    return length < (long)size ? length : -1;
+}
+
+/*
+ * Adds a file loaded from disk to the server's cache and returns its node,
+ * retained for the caller. The cache takes over filedata->data. If another
+ * request cached the file meanwhile, that node is returned instead.
+ * encodings records the precompressed variants of the file, encoding is the
+ * Content-Encoding of filedata itself.
+ */
+cache_node *server_cache_file(http_server *server, char *key, char *content_type, file_data *filedata, int encodings, int encoding)
+{
+    if (server->cache == NULL)
+    {
+        return NULL;
+    }
+    cache_node *node = allocate_node(key, content_type, filedata->data, filedata->size);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    filedata->data = NULL;
+    cache_node_set_last_modified(node, filedata->mtime);
+    node->encodings = encodings;
+    node->encoding = encoding;
+
+    // serialized before the node is shared, so hits only need a lookup and one writev
+    char header[1024];
+    long header_length = format_cached_headers(header, sizeof(header), node, encoding);
+    if (header_length < 0 || cache_node_set_response(node, header, header_length) < 0)
+    {
+        fprintf(stderr, "[Server:%d] Could not serialize the response for %s.\n", server->port, key);
+    }
+    else if (server->cache_storage == CACHE_STORAGE_MEMFD && cache_node_set_memfd(node) < 0)
+    {
+        fprintf(stderr, "[Server:%d] Could not move %s to a memfd. It is cached on the heap.\n", server->port, key);
+    }
+
+    lockstat_lock(&server->cache->mutex, &server->cache->mutex_stats);
+    cache_node *cached = cache_get(server->cache, key);
+    if (cached == NULL)
+    {
+        cached = cache_put_node(server->cache, node);
+        server->server_logs->cache_miss += 1;
+        node = NULL;
+    }
+    cache_retain(cached);
+    lockstat_unlock(&server->cache->mutex, &server->cache->mutex_stats);
+
+    free_cache_node(node);
+    return cached;
+}
+
+/* Looks up key in the server's cache. A node found is retained for the caller. */
+cache_node *server_cache_acquire(http_server *server, char *key)
+{
+    uint64_t span = trace_begin();
+    lockstat_lock(&server->cache->mutex, &server->cache->mutex_stats);
+    cache_node *node = cache_get(server->cache, key);
+    if (node)
+    {
+        cache_retain(node);
+        server->server_logs->cache_hits += 1;
+    }
+    lockstat_unlock(&server->cache->mutex, &server->cache->mutex_stats);
+    trace_end(TRACE_CACHE_LOOKUP, span);
+    return node;
+}
 
-    long rv = send(
-        new_socket_fd,
-        body,
-        content_length, 0);
+int response_416(http_server *server, int new_socket_fd, size_t size)
+{
+    char body[] = "<h1>416 Range Not Satisfiable</h1>";
+    char content_range[64];
+    snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%zu\n", size);
+    return send_http_response_headers(server, new_socket_fd, HEADER_416, "text/html", content_range, body, strlen(body));
+}
+
+/*
+ * The body of a file response. Either content in memory, borrowed from the
+ * cache or loaded with file_load(), or an open file sent with sendfile.
+ */
+typedef struct file_body
+{
+    const char *data;
+    int fd;
+    size_t fd_offset; // where the body starts in fd
+    size_t size;
+    cache_node *node; // owner of data, when it is cached
+} file_body;
+
+// drops the reference a queued or in-flight send holds on a cache node
+static void release_cache_node(void *node)
+{
+    cache_release((cache_node *)node);
+}
+
+/*
+ * Sends headers followed by the length bytes of body starting at offset.
+ * Content in memory goes out with the headers in one writev, files with sendfile.
+ * A NULL body sends the headers only, as the answer to a HEAD request.
+ */
+long send_file_response(http_server *server, int new_socket_fd, char *header, char *content_type, const char *extra_headers, file_body *body, size_t offset, size_t length)
+{
+    char response[4096];
+    long response_length = format_response_headers(response, sizeof(response), header, content_type, extra_headers, length);
+    if (response_length < 0)
+    {
+        log_error("[Server:%d] Response headers exceed %ld bytes.\n", server->port, (long)sizeof(response));
+        return -1;
+    }
+
+    if (body == NULL)
+    {
+        return writev_all(new_socket_fd, (struct iovec[]){{response, response_length}}, 1);
+    }
+    if (body->data != NULL)
+    {
+        struct iovec iov[2] = {{response, response_length}, {(char *)body->data + offset, length}};
+        output_queue *output = connection_output(new_socket_fd);
+        if (output != NULL && body->node != NULL)
+        {
+            // a full socket queues a reference to the cached content, not a copy
+            cache_retain(body->node);
+            uint64_t span = trace_begin();
+            long rv = count_sent(output_writev(output, iov, 2, 0, 1, release_cache_node, body->node));
+            trace_end(TRACE_SEND, span);
+            return rv;
+        }
+        return writev_all(new_socket_fd, iov, 2);
+    }
+    long rv_header = sendmsg_all(new_socket_fd, (struct iovec[]){{response, response_length}}, 1, MSG_MORE);
+    if (rv_header < 0)
+    {
+        return -1;
+    }
+    long rv = sendfile_all(new_socket_fd, body->fd, body->fd_offset + offset, length);
+    return rv < 0 ? rv_header : rv_header + rv;
+}
+
+/*
+ * Sends the serialized response of node. Only the headers that differ between
+ * requests are formatted: the Cache-Control of policy, Expires for HTTP/1.0
+ * clients and Date. They go out in the same writev as the stored bytes.
+ * head_only leaves out the content, for HEAD requests.
+ */
+long send_cached_response(http_server *server, int new_socket_fd, cache_node *node, const cache_policy *policy, int minor_version, int head_only)
+{
+    char headers[CACHE_POLICY_HEADER_SIZE + 2 * HTTP_DATE_SIZE + 32];
+    int length = snprintf(headers, sizeof(headers), "%sDate: %s\n", policy ? policy->header : "", http_date_now());
+    if (policy != NULL && minor_version == 0)
+    {
+        length += cache_policy_expires(policy, time(NULL), headers + length, sizeof(headers) - length);
+    }
+    headers[length++] = '\n';
+    current_status = 200; // only full responses are cached
+
+    if (head_only)
+    {
+        return writev_all(new_socket_fd, (struct iovec[]){{node->response, node->header_length}, {headers, length}}, 2);
+    }
+
+    output_queue *output = connection_output(new_socket_fd);
+    if (node->memfd < 0 && server->zerocopy != NULL && server->zerocopy_threshold > 0 &&
+        (size_t)node->content_length >= server->zerocopy_threshold &&
+        (output == NULL || !output_pending(output)) && zerocopy_enable(new_socket_fd) == 0)
+    {
+        // only the content is sent in place. The headers live on this stack frame
+        struct iovec iov[2] = {{node->response, node->header_length}, {headers, length}};
+        long rv_header = sendmsg_all(new_socket_fd, iov, 2, MSG_MORE);
+        if (rv_header < 0)
+        {
+            return -1;
+        }
+        // once the headers had to be queued, so does the content
+        uint32_t num_sends = 0;
+        struct iovec content = {node->content, node->content_length};
+        uint64_t span = trace_begin();
+        long rv = output != NULL && output_pending(output) ? 0 : zerocopy_send(new_socket_fd, &content, 1, &num_sends);
+        if (num_sends > 0)
+        {
+            // the kernel reads the content until the sends complete. Evictions must not free it before
+            cache_retain(node);
+            zerocopy_reaper_add(server->zerocopy, new_socket_fd, num_sends, release_cache_node, node);
+        }
+        if (rv < 0)
+        {
+            // zerocopy failed before anything was sent. The content is copied instead of cut short
+            rv = 0;
+        }
+        count_sent(rv);
+        if ((size_t)rv < node->content_length)
+        {
+            // the socket filled up or ran out of memory for notifications. The rest takes the copying path
+            struct iovec rest = {node->content + rv, node->content_length - rv};
+            long rv_rest;
+            if (output != NULL)
+            {
+                // borrowed by the queue, not copied into it
+                cache_retain(node);
+                rv_rest = count_sent(output_writev(output, &rest, 1, 0, 0, release_cache_node, node));
+            }
+            else
+            {
+                rv_rest = send_iov(new_socket_fd, &rest, 1, 0);
+            }
+            rv = rv_rest < 0 ? rv : rv + rv_rest;
+        }
+        trace_end(TRACE_SEND, span);
+        return rv_header + rv;
+    }
+
+    if (node->memfd >= 0)
+    {
+        // the content goes from the memfd's pages to the socket without a copy in user space
+        struct iovec iov[2] = {{node->response, node->header_length}, {headers, length}};
+        long rv_header = sendmsg_all(new_socket_fd, iov, 2, MSG_MORE);
+        if (rv_header < 0)
+        {
+            return -1;
+        }
+        long rv = sendfile_all(new_socket_fd, node->memfd, node->header_length, node->content_length);
+        return rv < 0 ? rv_header : rv_header + rv;
+    }
+
+    struct iovec iov[3] = {
+        {node->response, node->header_length},
+        {headers, length},
+        {node->content, node->content_length}};
+    if (output != NULL)
+    {
+        // only the headers formatted here are copied if the socket fills up
+        cache_retain(node);
+        uint64_t span = trace_begin();
+        long rv = count_sent(output_writev(output, iov, 3, 0, 2, release_cache_node, node));
+        trace_end(TRACE_SEND, span);
+        return rv;
+    }
+    return writev_all(new_socket_fd, iov, 3);
+}
+
+/*
+ * Sends several ranges of body as multipart/byteranges. Every range is a
+ * slice of the cached buffer, or a sendfile of the open file, never a copy.
+ */
+long send_multirange_response(http_server *server, int new_socket_fd, char *content_type, const char *extra_headers, file_body *body, http_range *ranges, int num_ranges)
+{
+    char boundary[32], multipart_type[64];
+    static long boundary_counter = 0;
+    snprintf(boundary, sizeof(boundary), "cserve%016lx", (unsigned long)(__atomic_add_fetch(&boundary_counter, 1, __ATOMIC_RELAXED) * 0x9E3779B97F4A7C15UL));
+    snprintf(multipart_type, sizeof(multipart_type), "multipart/byteranges; boundary=%s", boundary);
+
+    // every part starts with its own headers. The length of the whole body is known up front
+    char parts[HTTP_MAX_RANGES][192], trailer[64];
+    int part_lengths[HTTP_MAX_RANGES];
+    size_t content_length = 0;
+    for (int i = 0; i < num_ranges; i++)
+    {
+        part_lengths[i] = snprintf(
+            parts[i], sizeof(parts[i]), "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+            boundary, content_type, ranges[i].start, ranges[i].end, body->size);
+        if (part_lengths[i] >= (int)sizeof(parts[i]))
+        {
+            log_error("[Server:%d] Part headers exceed %ld bytes.\n", server->port, (long)sizeof(parts[i]));
+            return -1;
+        }
+        content_length += part_lengths[i] + ranges[i].end - ranges[i].start + 1;
+    }
+    int trailer_length = snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n", boundary);
+    content_length += trailer_length;
+
+    char response[4096];
+    long response_length = format_response_headers(response, sizeof(response), HEADER_206, multipart_type, extra_headers, content_length);
+    if (response_length < 0)
+    {
+        log_error("[Server:%d] Response headers exceed %ld bytes.\n", server->port, (long)sizeof(response));
+        return -1;
+    }
+
+    if (body->data != NULL)
+    {
+        struct iovec iov[2 * HTTP_MAX_RANGES + 2];
+        int iovcnt = 0;
+        iov[iovcnt++] = (struct iovec){response, response_length};
+        for (int i = 0; i < num_ranges; i++)
+        {
+            iov[iovcnt++] = (struct iovec){parts[i], part_lengths[i]};
+            iov[iovcnt++] = (struct iovec){(char *)body->data + ranges[i].start, ranges[i].end - ranges[i].start + 1};
+        }
+        iov[iovcnt++] = (struct iovec){trailer, trailer_length};
+        return writev_all(new_socket_fd, iov, iovcnt);
+    }
+
+    long total = sendmsg_all(new_socket_fd, (struct iovec[]){{response, response_length}}, 1, MSG_MORE);
+    for (int i = 0; i < num_ranges && total >= 0; i++)
+    {
+        long rv_part = sendmsg_all(new_socket_fd, (struct iovec[]){{parts[i], part_lengths[i]}}, 1, MSG_MORE);
+        long rv = rv_part < 0 ? -1 : sendfile_all(new_socket_fd, body->fd, body->fd_offset + ranges[i].start, ranges[i].end - ranges[i].start + 1);
+        total = rv < 0 ? -1 : total + rv_part + rv;
+    }
+    long rv_trailer = total < 0 ? -1 : writev_all(new_socket_fd, (struct iovec[]){{trailer, trailer_length}}, 1);
+    return rv_trailer < 0 ? -1 : total + rv_trailer;
+}
+
+/*
+ * A file ready to be sent: the cache node holding it, or its content when
+ * the cache did not take it, or an open file descriptor.
+ */
+typedef struct file_source
+{
+    cache_node *node; // retained until file_source_close()
+    char *content_type;
+    file_data *filedata;
+    file_body body;
+    time_t mtime;
+} file_source;
+
+// returns the HTTP_ENCODING_* bits of the precompressed files (path.br, path.gz) next to path
+int file_encodings(const char *path)
+{
+    char variant_path[4096];
+    int encodings = 0;
+    for (int encoding = 1; encoding & HTTP_ENCODING_ALL; encoding <<= 1)
+    {
+        snprintf(variant_path, sizeof(variant_path), "%s%s", path, http_encoding_extension(encoding));
+        if (access(variant_path, R_OK) == 0)
+        {
+            encodings |= encoding;
+        }
+    }
+    return encodings;
+}
+
+/*
+ * Finds the file at path in the cache and fills the cache on a miss. Without
+ * use_cache the file is only opened, to be sent with sendfile. mime_type and
+ * encoding describe a precompressed variant of a file; for the file itself
+ * pass NULL and 0, so the content type is taken from the name only when the
+ * cache misses, and the variants next to the file are recorded.
+ * A variant is cached under its path tagged with the encoding, so it never
+ * answers a request for the .br or .gz file itself, which is sent as is.
+ * Returns 0, or -1 if the file cannot be read.
+ */
+int file_source_open(http_server *server, char *path, char *mime_type, int encoding, int use_cache, file_source *source)
+{
+    source->node = NULL;
+    source->content_type = mime_type;
+    source->filedata = NULL;
+    source->body = (file_body){NULL, -1, 0, 0, NULL};
+    source->mtime = 0;
+
+    char key_buffer[4096];
+    char *key = path;
+    if (use_cache && encoding != 0)
+    {
+        snprintf(key_buffer, sizeof(key_buffer), "%s#%s", path, http_encoding_name(encoding));
+        key = key_buffer;
+    }
+
+    if (use_cache)
+    {
+        source->node = server_cache_acquire(server, key);
+        if (source->node == NULL)
+        {
+            if (source->content_type == NULL)
+            {
+                source->content_type = mime_type_get(path);
+            }
+            // printf("[Server:%d] Loading data from %s\n", server->port, path);
+            uint64_t span = trace_begin();
+            file_data *filedata = file_load(path);
+            if (filedata == NULL)
+            {
+                trace_end(TRACE_FILE_LOAD, span);
+                return -1;
+            }
+            int probe = encoding == 0 && mime_type_compressible(source->content_type);
+            // the cache computes the validators when it takes the file over
+            source->node = server_cache_file(server, key, source->content_type, filedata, probe ? file_encodings(path) : 0, encoding);
+            trace_end(TRACE_FILE_LOAD, span);
+            if (source->node != NULL)
+            {
+                file_free(filedata); // file data is now inside the cache. Free filedata struct
+            }
+            else
+            {
+                log_error("[Server:%d] [cache manager] An error occured while storing data in cache.\n", server->port);
+                source->filedata = filedata;
+                source->body.data = filedata->data;
+                source->body.size = filedata->size;
+                source->mtime = filedata->mtime;
+                return 0;
+            }
+        }
+    }
+    if (source->node != NULL && source->node->encoding != encoding)
+    {
+        // a file whose name looks like a tagged key; it is sent from disk instead
+        cache_release(source->node);
+        source->node = NULL;
+        source->content_type = mime_type;
+    }
+    else if (source->node != NULL)
+    {
+        source->content_type = source->node->content_type;
+        if (source->node->memfd >= 0)
+        {
+            // slices of the file are sent from the memfd as well
+            source->body.fd = source->node->memfd;
+            source->body.fd_offset = source->node->header_length;
+        }
+        else
+        {
+            source->body.data = source->node->content; // only borrows the cached content
+            source->body.node = source->node;
+        }
+        source->body.size = source->node->content_length;
+        source->mtime = source->node->last_modified;
+        return 0;
+    }
 
-    if (rv < 0)
+    if (source->content_type == NULL)
     {
-        perror("Could not send response.");
+        source->content_type = mime_type_get(path);
     }
-    // clean up response buffers
-    // free(response);
-    // response = NULL;
-    return rv + rv_header;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    source->body.fd = fd;
+    source->body.size = st.st_size;
+    source->mtime = st.st_mtime;
+    return 0;
 }
 
-int send_stream_http_response(http_server *server, int new_socket_fd, char *header, char *content_type, int *fd_ptr, size_t content_length)
+void file_source_close(file_source *source)
 {
-    const long max_response_size = 4096;
-    char *response = (char *)malloc(sizeof(char) * max_response_size);
-    long response_length;
-    long body_size = content_length;
-    int fd = *fd_ptr;
-    sprintf(
-        response,
-        "%s\n"
-        "Content-Length: %ld\n"
-        "Content-Type: %s\n"
-        "Connection: close\n"
-        "\n",
-        header, body_size, content_type);
-
-    response_length = strlen(response);
-
-    long rv = write(
-        new_socket_fd,
-        response,
-        response_length);
-
-    int loc = lseek(fd, 0, SEEK_SET);
-    long bytes = sendfile(new_socket_fd, fd, NULL, content_length);
-
-    if (rv < 0)
+    // the memfd of a cached file belongs to its node
+    if (source->body.fd >= 0 && source->node == NULL)
     {
-        perror("Could not send response.");
+        close(source->body.fd);
     }
-    // clean up response buffers
-    free(response);
-    response = NULL;
-    return rv + bytes;
+    cache_release(source->node);
+    source->node = NULL;
+    file_free(source->filedata);
+    source->filedata = NULL;
 }
 
-int send_image_response(http_server *server, int new_socket_fd, char *header, char *content_type, char *data, size_t content_length)
+/*
+ * Tells whether the content of source still has fingerprint. Cached files
+ * carry the same hash in their ETag; files read from disk are hashed again.
+ */
+static int file_source_has_fingerprint(file_source *source, const char *fingerprint)
 {
-    const long max_response_size = server->max_response_size;
-    char *response = (char *)malloc(sizeof(char) * max_response_size);
-    long response_length, body_size;
-    body_size = content_length;
-
-    sprintf(
-        response,
-        "%s\n"
-        "Content-Length: %ld\n"
-        "Content-Type: %s\n"
-        "Connection: close\n"
-        "\n",
-        header, body_size, content_type);
-
-    response_length = strlen(response);
-
-    long rv = write(
-        new_socket_fd,
-        response,
-        response_length);
-
-    long img_bytes = send(new_socket_fd, data, content_length, 0);
-
-    if (rv < 0 || img_bytes < 0)
+    char current[ASSET_FINGERPRINT_LEN + 1];
+    if (source->node != NULL)
     {
-        perror("Could not send response.\n");
+        return strncmp(source->node->etag + 1, fingerprint, ASSET_FINGERPRINT_LEN) == 0;
     }
-
-    free(response);
-    response = NULL;
-    return rv + img_bytes;
+    if (source->body.data != NULL)
+    {
+        asset_format_fingerprint(hash64(source->body.data, source->body.size, 0), current);
+    }
+    else if (asset_hash_fd(source->body.fd, current) < 0)
+    {
+        return 0;
+    }
+    return strcmp(current, fingerprint) == 0;
 }
 
-int response_404(http_server *server, int new_socket_fd)
+static int send_file(http_server *server, int new_socket_fd, http_request *request, char *path, int use_cache, const cache_policy *policy, const char *fingerprint);
+
+/*
+ * Sends the file at path. use_cache selects whether the server's LRU cache
+ * is consulted and filled for this file; files that are not cached are sent
+ * from disk with sendfile. If request is not NULL:
+ * - a precompressed path.br or path.gz is sent instead of a text file when the
+ *   client accepts it. Each variant is cached under its own key.
+ * - conditional requests matching the ETag or Last-Modified date of the file
+ *   are answered with 304.
+ * - Range requests are answered with the requested slices of the file.
+ * policy sets the Cache-Control of the response, and Expires for HTTP/1.0. NULL sends neither.
+ */
+int file_response(http_server *server, int new_socket_fd, http_request *request, char *path, int use_cache, const cache_policy *policy)
 {
-    char body[] = "<h1>404 Page Not Found</h1>";
-    char header[] = "HTTP/1.1 404 NOT FOUND";
-    char content_type[] = "text/html";
-    int bytes_sent = send_http_response(
-        server, new_socket_fd, header, content_type, body, strlen(body));
-    return bytes_sent;
+    return send_file(server, new_socket_fd, request, path, use_cache, policy, NULL);
 }
 
-int file_response_handler(http_server *server, int new_socket_fd, char *path)
+/*
+ * file_response() for a file requested by a fingerprinted name. fingerprint
+ * is the one the name carried, NULL for other names. The fingerprints are
+ * computed once, so the file may have changed since; a name that no longer
+ * matches the content is answered with 404 rather than pinning the new
+ * content under it.
+ */
+static int send_file(http_server *server, int new_socket_fd, http_request *request, char *path, int use_cache, const cache_policy *policy, const char *fingerprint)
 {
-    file_data *filedata;
-    char *mime_type, *file_type = NULL;
-    int cached = 0;
     int bytes_sent = 0;
+    use_cache = use_cache && server->cache != NULL;
 
-    // fprintf(stdout, "[Server:%d] [cache manager] retreiving key=%s from cache\n", server->port, path);
-    cache_node *node = server_cache_manager(server, 1, path, NULL, NULL, 0);
-
-    if (node == NULL)
+    file_source source;
+    if (file_source_open(server, path, NULL, 0, use_cache, &source) < 0)
+    {
+        log_info("[Server:%d] File %.*s not found on server!\n", server->port, (int)strlen(path), path);
+        char message[1024];
+        sprintf(message, "File %.*s not found on Server!\n", (int)strlen(path), path);
+        bytes_sent = send_http_response(server, new_socket_fd, HEADER_404, "text/html", message, strlen(message));
+        return bytes_sent;
+    }
+    if (fingerprint != NULL && !file_source_has_fingerprint(&source, fingerprint))
     {
-        mime_type = mime_type_get(path);
-        file_type = strchr(mime_type, '/');
-        file_type += 1;
+        log_info("[Server:%d] %s changed since it was fingerprinted as %s.\n", server->port, path, fingerprint);
+        file_source_close(&source);
+        return response_404(server, new_socket_fd);
+    }
+    char *mime_type = source.content_type;
+    int compressible = mime_type_compressible(mime_type);
 
-        // pthread_mutex_lock(&server->lock);
-        // server->server_logs->cache_miss += 1;
-        // pthread_mutex_unlock(&server->lock);
+    // cached files know their variants. Without the cache, opening the variant tells whether it exists
+    int encoding = 0;
+    if (request != NULL && compressible)
+    {
+        int available = source.node != NULL ? source.node->encodings : HTTP_ENCODING_ALL;
+        int accepted = http_request_accepted_encodings(request) & available;
+        while ((encoding = http_encoding_preferred(accepted)) != 0)
+        {
+            char variant_path[4096];
+            file_source variant;
+            snprintf(variant_path, sizeof(variant_path), "%s%s", path, http_encoding_extension(encoding));
+            if (file_source_open(server, variant_path, mime_type, encoding, use_cache, &variant) == 0)
+            {
+                file_source_close(&source);
+                source = variant;
+                break;
+            }
+            accepted &= ~encoding;
+        }
+    }
 
-        // printf("[Server:%d] Loading data from %s\n", server->port, path);
-        filedata = file_load(path);
-        // filedata = read_file_fd(path);
+    char etag_buffer[CACHE_ETAG_SIZE], date_buffer[HTTP_DATE_SIZE];
+    const char *etag, *last_modified;
+    if (source.node != NULL)
+    {
+        etag = source.node->etag;
+        last_modified = source.node->last_modified_date;
     }
     else
     {
-        mime_type = node->content_type;
-        filedata = (file_data *)malloc(sizeof(file_data));
-        filedata->data = node->content;
-        filedata->size = node->content_length;
-        filedata->filename = node->key;
-        mime_type = mime_type_get(filedata->filename);
-        file_type = strchr(mime_type, '/');
-        file_type += 1;
-        cached = 1;
+        // uncached files are not hashed on every request; size and modification time identify them instead
+        snprintf(etag_buffer, sizeof(etag_buffer), "\"%lx-%zx\"", (long)source.mtime, source.body.size);
+        http_format_date(source.mtime, date_buffer);
+        etag = etag_buffer;
+        last_modified = date_buffer;
+    }
+
+    http_range ranges[HTTP_MAX_RANGES];
+    int num_ranges = -1;
+    const struct phr_header *range = request ? http_request_header_id(request, HTTP_HEADER_RANGE) : NULL;
+    if (range != NULL && request->method == HTTP_METHOD_GET && http_request_range_applies(request, etag, last_modified))
+    {
+        num_ranges = http_parse_range(range->value, range->value_len, source.body.size, ranges, HTTP_MAX_RANGES);
     }
 
-    if (filedata == NULL)
+    // a HEAD request gets the headers a GET would, without the content
+    int head_only = request != NULL && request->method == HTTP_METHOD_HEAD;
+    int not_modified = http_request_not_modified(request, etag, last_modified, source.mtime);
+    if (!not_modified && num_ranges < 0 && source.node != NULL && source.node->response != NULL)
     {
-        fprintf(stderr, "[Server:%d] File %.*s not found on server!\n", server->port, (int)strlen(path), path);
-        char body[1024];
-        sprintf(body, "File %.*s not found on Server!\n", (int)strlen(path), path);
-        bytes_sent = send_http_response(server, new_socket_fd, HEADER_404, "text/html", body, strlen(body));
+        bytes_sent = send_cached_response(server, new_socket_fd, source.node, policy, request ? request->minor_version : 1, head_only);
+        file_source_close(&source);
         return bytes_sent;
     }
 
-    bytes_sent = send_http_response(server, new_socket_fd, HEADER_OK, mime_type, filedata->data, filedata->size);
-    // bytes_sent = send_stream_http_response(server, new_socket_fd, HEADER_OK, mime_type, (int *)filedata->data, filedata->size);
+    // the headers a 304 repeats come first
+    char extra_headers[CACHE_ETAG_SIZE + 2 * HTTP_DATE_SIZE + CACHE_POLICY_HEADER_SIZE + 192];
+    int extra_length = snprintf(
+        extra_headers, sizeof(extra_headers), "ETag: %s\nLast-Modified: %s\n%s%s",
+        etag, last_modified, compressible ? "Vary: Accept-Encoding\n" : "", policy ? policy->header : "");
+    if (policy != NULL && request != NULL && request->minor_version == 0)
+    {
+        extra_length += cache_policy_expires(policy, time(NULL), extra_headers + extra_length, sizeof(extra_headers) - extra_length);
+    }
 
-    if (server->cache == NULL)
-        file_free(filedata);
+    if (not_modified)
+    {
+        bytes_sent = response_304(server, new_socket_fd, extra_headers);
+        file_source_close(&source);
+        return bytes_sent;
+    }
+
+    extra_length += snprintf(extra_headers + extra_length, sizeof(extra_headers) - extra_length, "Accept-Ranges: bytes\n");
+    if (encoding != 0)
+    {
+        extra_length += snprintf(extra_headers + extra_length, sizeof(extra_headers) - extra_length, "Content-Encoding: %s\n", http_encoding_name(encoding));
+    }
+
+    file_body *body = &source.body;
+    if (num_ranges == 0)
+    {
+        bytes_sent = response_416(server, new_socket_fd, body->size);
+    }
+    else if (num_ranges == 1)
+    {
+        snprintf(extra_headers + extra_length, sizeof(extra_headers) - extra_length, "Content-Range: bytes %zu-%zu/%zu\n", ranges[0].start, ranges[0].end, body->size);
+        bytes_sent = send_file_response(server, new_socket_fd, HEADER_206, mime_type, extra_headers, body, ranges[0].start, ranges[0].end - ranges[0].start + 1);
+    }
+    else if (num_ranges > 1)
+    {
+        bytes_sent = send_multirange_response(server, new_socket_fd, mime_type, extra_headers, body, ranges, num_ranges);
+    }
     else
     {
-        if (!cached)
-        {
-            // fprintf(stdout, "[Server:%d] [cache manager] Adding key=%s to cache\n", server->port, path);
-            if (
-                server_cache_manager(server, 0, path, mime_type, filedata->data, filedata->size) == NULL)
-            {
-                fprintf(stderr, "[Server:%d] [cache manager] An error occured while storing data in cache.\n", server->port);
-                return bytes_sent;
-            }
-        }
-        free(filedata); // file data is now inside the cache. Free filedata struct
+        bytes_sent = send_file_response(server, new_socket_fd, HEADER_OK, mime_type, extra_headers, head_only ? NULL : body, 0, body->size);
     }
-    filedata = NULL;
+
+    file_source_close(&source);
     return bytes_sent;
 }
 
 struct thread_payload
 {
     http_server *server;
-    http_server_logs *logs;
+    worker_stats *stats; // of the worker handling the request
+    int rank;            // of the worker handling the request
     int new_socket_fd;
+    uint8_t address[16];      // of the client, as stored in the access log
+    uint32_t trace_id;        // of the sampled connection, 0 if it is not traced
+    struct timespec accepted; // CLOCK_MONOTONIC, when the connection was accepted
+    pool *pool;           // pool the payload is returned to
+    char *request_buffer; // worker owned buffer of REQUEST_BUFFER_SIZE bytes
+    arena *arena;         // worker owned arena, reset after every request
+    output_queue output;  // what the socket did not accept yet
 };
 
+void close_request(struct thread_payload *payload)
+{
+    current_output = NULL;
+    current_minor_version = 1;
+    if (output_pending(&payload->output))
+    {
+        // the output thread sends the rest and closes the connection. The worker moves on
+        output_loop_add(payload->server->output, &payload->output);
+    }
+    else
+    {
+        shutdown(payload->new_socket_fd, SHUT_RDWR);
+        close(payload->new_socket_fd);
+    }
+    arena_reset(payload->arena);
+    pool_free(payload->pool, payload);
+}
+
 void *handle_http_request(void *arg)
 {
     struct thread_payload *payload = (struct thread_payload *)arg;
     http_server *server = payload->server;
-    http_server_logs *logs = payload->logs;
+    worker_stats *stats = payload->stats;
     int new_socket_fd = payload->new_socket_fd;
 
     struct timespec
@@ -410,39 +1608,42 @@ void *handle_http_request(void *arg)
         res_start,
         res_end;
 
-    const long request_buffer_size = 4096;
-    char *request = (char *)malloc(request_buffer_size);
-    if (request == NULL)
+    const long request_buffer_size = REQUEST_BUFFER_SIZE;
+    char *request = payload->request_buffer;
+
+    output_queue_init(&payload->output, new_socket_fd);
+    current_output = &payload->output;
+    current_bytes_sent = 0;
+    current_status = 0;
+
+    // the socket is non-blocking. Give a client that connected but did not send yet some time
+    int bytes_received;
+    while ((bytes_received = recv(new_socket_fd, request, request_buffer_size - 1, 0)) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
     {
-        fprintf(stderr, "[Server:%d] Did not receive any bytes in the request.\n", server->port);
-        free(request);
-        shutdown(new_socket_fd, SHUT_RDWR);
-        close(new_socket_fd);
-        return NULL;
+        if (errno != EINTR && poll(&(struct pollfd){new_socket_fd, POLLIN, 0}, 1, REQUEST_TIMEOUT) <= 0)
+        {
+            break;
+        }
     }
-    char *p;
-
-    int bytes_received = recv(new_socket_fd, request, request_buffer_size - 1, 0);
 
     if (bytes_received < 0)
     {
-        fprintf(stderr, "[Server:%d] Did not receive any bytes in the request.\n", server->port);
-        free(request);
-        shutdown(new_socket_fd, SHUT_RDWR);
-        close(new_socket_fd);
+        log_info("[Server:%d] Did not receive any bytes in the request.\n", server->port);
+        close_request(payload);
         return NULL;
     }
     else
     {
-        logs->num_bytes_received += bytes_received;
+        stats_count(stats, STATS_BYTES_RECEIVED, bytes_received);
     }
 
     request[bytes_received] = '\0';
     clock_gettime(CLOCK_MONOTONIC, &req_parse_start);
 
-    const char *method, *path;
+    const char *method = NULL, *path = NULL;
     int pret, minor_version;
-    struct phr_header headers[100];
+    struct phr_header headers[HTTP_MAX_HEADERS];
     size_t buflen = 0, method_len, path_len, num_headers;
 
     num_headers = sizeof(headers) / sizeof(headers[0]);
@@ -452,26 +1653,19 @@ void *handle_http_request(void *arg)
 
     if (pret == -1)
     {
-        fprintf(stderr, "[Server:%d] Could not parse the headers in the request.\n", server->port);
-        free(request);
-        shutdown(new_socket_fd, SHUT_RDWR);
-        close(new_socket_fd);
+        log_info("[Server:%d] Could not parse the headers in the request.\n", server->port);
+        close_request(payload);
         return NULL;
     }
     // now we have parsed the request obtained.
     // determine if the path request is a registered path
-    char get[] = "GET";
-    char post[] = "POST";
-
     if (path == NULL)
     {
-        free(request);
-        shutdown(new_socket_fd, SHUT_RDWR);
-        close(new_socket_fd);
+        close_request(payload);
         return NULL;
     }
 
-    char *path_split = strchr(path, ' ');
+    char *path_split = (char *)path + path_len;
     *path_split = '\0';
 
     char *params_split = strchr(path, '?');
@@ -482,88 +1676,183 @@ void *handle_http_request(void *arg)
         *params_split = '\0';
     }
 
-    path_len = strlen(path);
-    char *search_path = (char *)malloc(path_len + 1);
-    sprintf(search_path, "%.*s", (int)path_len, path);
-
-    char *search_method = (char *)malloc(method_len + 1);
-    sprintf(search_method, "%.*s", (int)method_len, method);
-
-    if (strcmp(get, search_method) == 0)
+    // path is terminated inside the request buffer. It is normalized in place, so that
+    // equivalent paths find the same route and cache entry and cannot leave the server root
+    char *search_path = (char *)path;
+    long normalized_len = http_path_normalize(search_path, strlen(search_path));
+    if (normalized_len < 0)
+    {
+        log_info("[Server:%d] 400 Malformed request path!\n", server->port);
+        stats_count(stats, STATS_BYTES_SENT, response_400(server, new_socket_fd));
+        stats_count(stats, STATS_REQUESTS, 1);
+        close_request(payload);
+        return NULL;
+    }
+    path_len = normalized_len;
+
+    http_method request_method = http_method_parse(method, method_len);
+
+    // the parsed request is kept for handlers, so they never parse it again
+    http_request parsed_request;
+    parsed_request.method = request_method;
+    parsed_request.method_name = method;
+    parsed_request.method_len = method_len;
+    parsed_request.path = search_path;
+    parsed_request.path_len = path_len;
+    parsed_request.query = params;
+    parsed_request.query_len = params ? strlen(params) : 0;
+    parsed_request.minor_version = minor_version;
+    current_minor_version = minor_version;
+    parsed_request.headers = headers;
+    parsed_request.num_headers = num_headers;
+    parsed_request.body = pret > 0 ? request + pret : NULL;
+    parsed_request.body_len = pret > 0 ? bytes_received - pret : 0;
+    parsed_request.arena = payload->arena;
+    parsed_request.params = NULL;
+    parsed_request.params_buffer = NULL;
+    parsed_request.num_params = 0;
+    parsed_request.params_decoded = 0;
+    http_request_index_headers(&parsed_request);
+
+    if (request_method == HTTP_METHOD_GET)
     {
-        logs->num_get_requests += 1;
+        stats_count(stats, STATS_GET_REQUESTS, 1);
     }
     else
     {
-        fprintf(stderr, "%*.s PATH=%*.s\n", (int)method_len, method, (int)path_len, path);
+        log_debug("[Server:%d] %.*s PATH=%.*s\n", server->port, (int)method_len, method, (int)path_len, path);
     }
 
     clock_gettime(CLOCK_MONOTONIC, &req_parse_end); // request parsing completed.
     int bytes_sent = 0;
-    if (strstr(search_path, ".") != NULL)
+    uint64_t handler_cpu = 0;
+
+    // exact routes take precedence over the static file mounts
+    clock_gettime(CLOCK_MONOTONIC, &search_start);
+    route_node *req_route = route_lookup(server->route_table, search_path, path_len);
+    if (req_route == NULL)
+    {
+        req_route = route_match_mount(server->route_table, search_path, path_len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &search_end);
+    if (trace_request != 0)
     {
-        clock_gettime(CLOCK_MONOTONIC, &search_start);
-        clock_gettime(CLOCK_MONOTONIC, &search_end);
+        trace_record(trace_thread, TRACE_PARSE, trace_request, trace_ns(&req_parse_start), trace_ns(&req_parse_end));
+        trace_record(trace_thread, TRACE_ROUTE_LOOKUP, trace_request, trace_ns(&search_start), trace_ns(&search_end));
+    }
 
-        // if request path is a resource on server and not a route, then respond with a file
-        char resource_path[4096];
-        sprintf(resource_path, "%s/%s", server->server_root_dir, search_path);
+    if (req_route == NULL)
+    {
+        log_info("[Server:%d] 404 %.*s Page Not found!\n", server->port, (int)path_len, search_path);
         clock_gettime(CLOCK_MONOTONIC, &res_start);
-        bytes_sent = file_response_handler(server, new_socket_fd, resource_path);
+        bytes_sent = response_404(server, new_socket_fd);
         clock_gettime(CLOCK_MONOTONIC, &res_end);
     }
-    else
+    else if (!route_check_method(req_route, request_method))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &res_start);
+        bytes_sent = response_405(server, new_socket_fd, req_route);
+        clock_gettime(CLOCK_MONOTONIC, &res_end);
+    }
+    else if (req_route->is_mount)
     {
-        clock_gettime(CLOCK_MONOTONIC, &search_start);
-        route_node *req_route = route_search(server->route_table, search_path);
-        clock_gettime(CLOCK_MONOTONIC, &search_end);
-        if (req_route == NULL || !route_check_method(req_route, search_method))
+        // the part of the path below the mount prefix names the file inside the mount directory
+        char resource_path[4096];
+        sprintf(
+            resource_path, "%s%s%s%s", server->server_root_dir,
+            req_route->route_dir[0] ? "/" : "", req_route->route_dir, search_path + req_route->key_len);
+        clock_gettime(CLOCK_MONOTONIC, &res_start);
+        // a policy for the file's extension is more specific than the one of the mount
+        const cache_policy *policy = cache_policy_map_get(server->cache_policies, resource_path);
+        if (policy == NULL && req_route->cache_policy.header[0] != '\0')
+        {
+            policy = &req_route->cache_policy;
+        }
+        // a fingerprinted name is served, immutable, only while the file still has that fingerprint
+        char *relative = resource_path + strlen(server->server_root_dir);
+        while (*relative == '/')
         {
-            fprintf(stderr, "[Server:%d] 404 Page Not found!\n", server->port);
-            clock_gettime(CLOCK_MONOTONIC, &res_start);
-            bytes_sent = response_404(server, new_socket_fd);
-            clock_gettime(CLOCK_MONOTONIC, &res_end);
+            relative++;
         }
-        else if (req_route->value != NULL)
+        const char *fingerprint = NULL;
+        if (server->assets && asset_strip_fingerprint(server->assets, relative, strlen(relative)) >= 0)
+        {
+            fingerprint = asset_fingerprint(server->assets, relative);
+            policy = &server->asset_policy;
+        }
+        bytes_sent = send_file(server, new_socket_fd, &parsed_request, resource_path, req_route->mount_flags & MOUNT_CACHE, policy, fingerprint);
+        clock_gettime(CLOCK_MONOTONIC, &res_end);
+    }
+    else if (req_route->value != NULL)
+    {
+        char file_path[4096];
+        sprintf(file_path, "%s/%s", server->server_root_dir, req_route->value);
+        clock_gettime(CLOCK_MONOTONIC, &res_start);
+        bytes_sent = file_response(server, new_socket_fd, &parsed_request, file_path, 1, cache_policy_map_get(server->cache_policies, file_path));
+        clock_gettime(CLOCK_MONOTONIC, &res_end);
+    }
+    else
+    {
+        char dir_path[4096];
+        sprintf(dir_path, "%s/%s", server->server_root_dir, req_route->route_dir ? req_route->route_dir : "");
+        struct timespec cpu_start, cpu_end;
+        clock_gettime(CLOCK_MONOTONIC, &res_start);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+        if (req_route->request_fn)
         {
-            char file_path[4096];
-            sprintf(file_path, "%s/%s", server->server_root_dir, req_route->value);
-            clock_gettime(CLOCK_MONOTONIC, &res_start);
-            bytes_sent = file_response_handler(server, new_socket_fd, file_path);
-            clock_gettime(CLOCK_MONOTONIC, &res_end);
+            req_route->request_fn(server, new_socket_fd, &parsed_request, dir_path, req_route->fn_args);
         }
         else
         {
-            char dir_path[4096];
-            sprintf(dir_path, "%s/%s", server->server_root_dir, req_route->route_dir);
-            clock_gettime(CLOCK_MONOTONIC, &res_start);
             req_route->route_fn(server, new_socket_fd, dir_path, req_route->fn_args);
-            clock_gettime(CLOCK_MONOTONIC, &res_end);
         }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+        clock_gettime(CLOCK_MONOTONIC, &res_end);
+        handler_cpu = elapsed_ns(&cpu_start, &cpu_end);
+        if (trace_request != 0)
+        {
+            trace_record(trace_thread, TRACE_HANDLER, trace_request, trace_ns(&res_start), trace_ns(&res_end));
+        }
+        // handlers do not report what they sent. The send helpers counted it
+        bytes_sent = current_bytes_sent;
     }
 
-    logs->num_requests_served += 1;
-    logs->num_bytes_sent += bytes_sent;
-    shutdown(new_socket_fd, SHUT_RDWR);
-    close(new_socket_fd);
+    if (req_route != NULL)
+    {
+        route_stats_record(req_route->stats, bytes_sent > 0 ? bytes_sent : 0, elapsed_ns(&res_start, &res_end), handler_cpu);
+    }
 
-    if (search_path)
-        free(search_path);
-    if (request)
-        free(request);
-    if (search_method)
-        free(search_method);
+    if (server->access_log != NULL)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        access_record record;
+        record.timestamp = now.tv_sec * 1000000000UL + now.tv_nsec;
+        record.path_hash = hash64(search_path, path_len, 0);
+        memcpy(record.address, payload->address, sizeof(record.address));
+        record.bytes_sent = bytes_sent > 0 ? bytes_sent : 0;
+        record.latency_us = elapsed_ns(&req_parse_start, &res_end) / 1000;
+        record.status = current_status;
+        record.method = request_method;
+        record.reserved = 0;
+        access_log_append(server->access_log, payload->rank, &record);
+    }
 
-    free(payload);
+    http_request_cleanup(&parsed_request);
+    stats_count(stats, STATS_REQUESTS, 1);
+    stats_count(stats, STATS_BYTES_SENT, bytes_sent);
+    close_request(payload);
     payload = NULL;
     request = NULL;
     search_path = NULL;
-    search_method = NULL;
 
-    double request_time = get_time_difference(&req_parse_start, &req_parse_end) * 1000;
-    double search_time = get_time_difference(&search_start, &search_end) * 1000;
-    double response_time = get_time_difference(&res_start, &res_end) * 1000;
-    // fprintf(stdout, "[Server:%d] Request Parsing: %lfms; Method Search: %lfms; Response: %lfms; Total Time: %lfms\n", server->port, request_time, search_time, response_time, request_time + search_time + response_time);
+    if (stats != NULL)
+    {
+        histogram_record(&stats->latency[STATS_PARSE], elapsed_ns(&req_parse_start, &req_parse_end));
+        histogram_record(&stats->latency[STATS_SEARCH], elapsed_ns(&search_start, &search_end));
+        histogram_record(&stats->latency[STATS_RESPONSE], elapsed_ns(&res_start, &res_end));
+        histogram_record(&stats->latency[STATS_TOTAL], elapsed_ns(&req_parse_start, &res_end));
+    }
     return NULL;
 }
 
@@ -694,6 +1983,82 @@ void queue_manager_ctx_destroy(struct queue_manager_ctx *ctx)
     ctx = NULL;
 }
 
+/*
+ * Fills queues with the statistics of each queue of accepted connections.
+ * Only valid while the server runs, e.g. from a route handler.
+ * Returns the number of queues reported.
+ */
+int server_queue_stats(http_server *server, worker_queue_stats *queue_stats, int max_queues)
+{
+    struct queue_manager_ctx *ctx = server->queue_ctx;
+    int num_queues = 0;
+    for (; ctx != NULL && num_queues < ctx->num_queues && num_queues < max_queues; num_queues++)
+    {
+        queues *queue = ctx->multi_queue[num_queues];
+        worker_queue_stats *stats = &queue_stats[num_queues];
+        stats->depth = __atomic_load_n(&queue->size, __ATOMIC_RELAXED);
+        stats->max_depth = __atomic_load_n(&queue->max_size, __ATOMIC_RELAXED);
+        stats->num_enqueued = __atomic_load_n(&queue->num_enqueued, __ATOMIC_RELAXED);
+        // workers take connections from the queue of their block, see queue_manager()
+        stats->first_worker = num_queues * ctx->block_dim;
+        stats->num_workers = ctx->grid_dim - stats->first_worker < ctx->block_dim ? ctx->grid_dim - stats->first_worker : ctx->block_dim;
+        stats->lock = (lock_stats){0, 0, 0, 0, 0};
+        lockstat_add(&stats->lock, &queue->mutex_stats);
+    }
+    return num_queues;
+}
+
+/*
+ * Fills stats with the contention of lock so far. The queues count from the
+ * first server_start(). All zero unless the library was built with CSERVE_LOCKSTAT.
+ */
+void server_lock_stats(http_server *server, server_lock lock, lock_stats *stats)
+{
+    *stats = (lock_stats){0, 0, 0, 0, 0};
+    if (lock == SERVER_LOCK_CACHE && server->cache != NULL)
+    {
+        lockstat_add(stats, &server->cache->mutex_stats);
+    }
+    else if (lock == SERVER_LOCK_QUEUES)
+    {
+        lockstat_add(stats, &server->queue_lock_stats);
+        struct queue_manager_ctx *ctx = server->queue_ctx;
+        for (int i = 0; ctx != NULL && i < ctx->num_queues; i++)
+        {
+            lockstat_add(stats, &ctx->multi_queue[i]->mutex_stats);
+        }
+    }
+    else if (lock == SERVER_LOCK_SERVER)
+    {
+        lockstat_add(stats, &server->lock_stats);
+    }
+}
+
+const char *server_lock_name(server_lock lock)
+{
+    static const char *names[SERVER_LOCK_COUNT] = {"cache", "queues", "server"};
+    return lock < SERVER_LOCK_COUNT ? names[lock] : "unknown";
+}
+
+/*
+ * Adds how long connections waited in queue before a worker took them to
+ * merged, in nanoseconds. Pass -1 for all queues. Only valid while the server runs.
+ */
+void server_queue_wait(http_server *server, int queue, histogram *merged)
+{
+    struct queue_manager_ctx *ctx = server->queue_ctx;
+    if (ctx == NULL || queue >= ctx->num_queues)
+    {
+        return;
+    }
+    if (queue < 0)
+    {
+        server_stats_queue_wait(server->stats, 0, ctx->grid_dim, merged);
+        return;
+    }
+    server_stats_queue_wait(server->stats, queue * ctx->block_dim, ctx->block_dim, merged);
+}
+
 struct thread_function_payload
 {
     struct queue_manager_ctx *ctx;
@@ -710,9 +2075,21 @@ void *thread_function_wrapper(void *arg)
     int rank = payload->rank;
     queues *queue = payload->queue;
     http_server *server = payload->server;
-    http_server_logs *thread_logs = (http_server_logs *)malloc(sizeof(http_server_logs));
+    worker_stats *stats = server_stats_worker(server->stats, rank);
     struct thread_payload *client_payload = NULL;
 
+    // per worker buffers, reused by every request the worker handles
+    char *request_buffer = (char *)malloc(REQUEST_BUFFER_SIZE);
+    arena *request_arena = arena_create(REQUEST_ARENA_SIZE);
+    if (stats == NULL || request_buffer == NULL || request_arena == NULL)
+    {
+        fprintf(stderr, "[Server:%d] [Thread:%d] Error allocating worker buffers.\n", server->port, rank);
+        exit(EXIT_FAILURE);
+    }
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "worker %d", rank);
+    trace_thread = trace_buffer_get(server->trace, rank, thread_name);
+
     while (status)
     {
         // pthread_mutex_lock(&queue->mutex);
@@ -723,23 +2100,38 @@ void *thread_function_wrapper(void *arg)
         if (client_payload != NULL)
         {
             // printf("[Server:%d] [Thread:%d] Picked up request.\n", server->port, rank);
-            client_payload->logs = thread_logs; // attach thread logs to the request
+            struct timespec picked_up;
+            clock_gettime(CLOCK_MONOTONIC, &picked_up);
+            histogram_record(&stats->queue_wait, elapsed_ns(&client_payload->accepted, &picked_up));
+            client_payload->stats = stats; // requests count into the worker's own statistics
+            client_payload->rank = rank;
+            client_payload->request_buffer = request_buffer;
+            client_payload->arena = request_arena;
+            trace_request = client_payload->trace_id;
+            uint64_t span = trace_begin();
+            if (span != 0)
+            {
+                trace_record(trace_thread, TRACE_DEQUEUE, trace_request, trace_ns(&client_payload->accepted), span);
+            }
             payload->fn(client_payload);
+            trace_end(TRACE_REQUEST, span);
+            trace_request = 0;
         }
         else
             msleep(0.5);
     }
 
-    pthread_mutex_lock(&server->lock);
-    server->server_logs->num_bytes_received += thread_logs->num_bytes_received;
-    server->server_logs->num_bytes_sent += thread_logs->num_bytes_sent;
-    server->server_logs->num_get_requests += thread_logs->num_get_requests;
-    server->server_logs->num_requests_served += thread_logs->num_requests_served;
-    pthread_mutex_unlock(&server->lock);
+    trace_thread = NULL;
+    lockstat_lock(&server->lock, &server->lock_stats);
+    server->server_logs->num_bytes_received += stats->counters[STATS_BYTES_RECEIVED];
+    server->server_logs->num_bytes_sent += stats->counters[STATS_BYTES_SENT];
+    server->server_logs->num_get_requests += stats->counters[STATS_GET_REQUESTS];
+    server->server_logs->num_requests_served += stats->counters[STATS_REQUESTS];
+    lockstat_unlock(&server->lock, &server->lock_stats);
     free(payload);
-    free(thread_logs);
+    free(request_buffer);
+    arena_destroy(request_arena);
     payload = NULL;
-    thread_logs = NULL;
 }
 
 http_server *create_server(int port, int cache_size, int hashsize, char *root_dir, long max_request_size, long max_response_size, int backlog)
@@ -781,9 +2173,38 @@ http_server *create_server(int port, int cache_size, int hashsize, char *root_di
         exit(EXIT_FAILURE);
     }
 
+    server->cache_policies = cache_policy_map_create();
+    if (server->cache_policies == NULL)
+    {
+        fprintf(stderr, "Error while creating cache policies for server on port %d\n", port);
+        exit(EXIT_FAILURE);
+    }
+    server->assets = NULL;
+    server->cache_storage = CACHE_STORAGE_HEAP;
+    server->zerocopy_threshold = DEFAULT_ZEROCOPY_THRESHOLD;
+    server->output = NULL;
+    server->zerocopy = NULL;
+    server->metrics_path = strdup(METRICS_DEFAULT_PATH);
+    server->queue_ctx = NULL;
+    server->access_log_path = NULL;
+    server->access_log = NULL;
+    server->trace_sample_rate = 0;
+    server->trace_path = NULL;
+    server->trace = NULL;
+    server->stats = server_stats_create(DEFAULT_THREAD_POOL_SIZE);
+    if (server->stats == NULL)
+    {
+        fprintf(stderr, "Error while allocating statistics for server on port %d\n", port);
+        destroy_server(server, 0);
+        exit(EXIT_FAILURE);
+    }
+    cache_policy_init(&server->asset_policy, ASSET_MAX_AGE, CACHE_POLICY_IMMUTABLE);
+
     server->max_response_size = max_response_size ? max_response_size : DEFAULT_MAX_RESPONSE_SIZE;
     server->max_request_size = max_request_size ? max_request_size : DEFAULT_MAX_RESPONSE_SIZE;
     server->lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    server->lock_stats = (lock_stats){0, 0, 0, 0, 0};
+    server->queue_lock_stats = (lock_stats){0, 0, 0, 0, 0};
     server->backlog = backlog ? backlog : DEFAULT_BACKLOG;
     server->server_logs->max_cache_size = cache_size;
     server->server_logs->num_bytes_sent = 0L;
@@ -851,10 +2272,80 @@ void server_start(http_server *server, int close_server, int print_logs)
     }
 
     signal(SIGINT, stop_server);
+    // a client closing early fails the send instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
+    // messages of the workers are written by a thread of their own
+    log_start();
+
+    // without explicit mounts, every file under the server root is served
+    if (server->route_table->num_mounts == 0)
+    {
+        register_mount(server->route_table, "/", "", MOUNT_CACHE);
+    }
+
+    // the statistics are reported unless an application route already uses the path
+    if (server->metrics_path != NULL && route_search(server->route_table, server->metrics_path) == NULL)
+    {
+        char *metrics_methods[1] = {"GET"};
+        register_route(server->route_table, server->metrics_path, NULL, metrics_methods, 1, NULL, metrics_response, NULL);
+    }
+
+    // routes do not change once the server is running. Compile them into the frozen lookup table
+    if (route_freeze(server->route_table) < 0)
+    {
+        fprintf(stderr, "[Server:%d] Could not freeze route table.\n", server->port);
+    }
+
+    // pick the fastest parser scanner for this CPU before any worker parses a request
+    http_parser_calibrate();
+
+    if (server->zerocopy_threshold > 0 && server->cache != NULL)
+    {
+        server->zerocopy = zerocopy_reaper_create();
+        if (server->zerocopy == NULL)
+        {
+            fprintf(stderr, "[Server:%d] Could not start zerocopy sends. Responses are copied.\n", server->port);
+        }
+    }
+
+    // responses that do not fit the socket buffer are finished here, off the workers
+    server->output = output_loop_create();
+    if (server->output == NULL)
+    {
+        fprintf(stderr, "[Server:%d] Could not start the output thread. Workers wait for slow clients.\n", server->port);
+    }
+
+    if (server->access_log_path != NULL)
+    {
+        // one ring per worker, so appending a record never takes a lock
+        server->access_log = access_log_open(server->access_log_path, DEFAULT_THREAD_POOL_SIZE);
+        if (server->access_log == NULL)
+        {
+            fprintf(stderr, "[Server:%d] Could not open the access log. Requests are not logged.\n", server->port);
+        }
+    }
+
+    if (server->trace_sample_rate > 0)
+    {
+        // a buffer for every worker, and the last one for the accepting thread
+        server->trace = trace_create(DEFAULT_THREAD_POOL_SIZE + 1, server->trace_sample_rate);
+        if (server->trace == NULL)
+        {
+            fprintf(stderr, "[Server:%d] Could not start tracing.\n", server->port);
+        }
+        else
+        {
+            trace_thread = trace_buffer_get(server->trace, DEFAULT_THREAD_POOL_SIZE, "acceptor");
+            signal(SIGUSR1, trace_signal_handler);
+        }
+    }
 
     // setup queue for storing incoming connections
     queues *queue = queue_create();
     struct queue_manager_ctx *ctx = queue_manager_ctx_initializer(DEFAULT_THREAD_POOL_SIZE, DEFAULT_BLOCK_DIM);
+    server->queue_ctx = ctx;
+    // payloads are allocated by this thread only and returned by the workers
+    pool *payload_pool = pool_create(sizeof(struct thread_payload), PAYLOAD_POOL_SLAB_SIZE);
     // create the default thread_function_payload arg
     // struct thread_function_payload fn_payload[DEFAULT_THREAD_POOL_SIZE];
 
@@ -873,9 +2364,19 @@ void server_start(http_server *server, int close_server, int print_logs)
 
     while (status)
     {
+        if (trace_dump_requested)
+        {
+            trace_dump_requested = 0;
+            if (trace_dump(server->trace, server->trace_path) == 0)
+            {
+                fprintf(stdout, "[Server:%d] Wrote trace to %s\n", server->port, server->trace_path);
+            }
+        }
         socklen_t sin_size = sizeof(client_addr);
         int new_socket_fd;
-        new_socket_fd = accept(server->socket_fd, (struct sockaddr *)&client_addr, &sin_size);
+        uint64_t accept_start = server->trace != NULL ? trace_now() : 0;
+        // connections are non-blocking, so a slow reader never stalls the worker sending to it
+        new_socket_fd = accept4(server->socket_fd, (struct sockaddr *)&client_addr, &sin_size, SOCK_NONBLOCK);
         if (new_socket_fd == -1)
         {
             if (errno == EWOULDBLOCK)
@@ -892,9 +2393,9 @@ void server_start(http_server *server, int close_server, int print_logs)
                     continue;
                 }
             }
-            else
+            else if (errno != EINTR)
             {
-                fprintf(stderr, "[Server:%d] An error occured while accepting a connection.\n", server->port);
+                log_warn("[Server:%d] An error occured while accepting a connection: %s\n", server->port, strerror(errno));
                 continue;
             }
         }
@@ -903,12 +2404,30 @@ void server_start(http_server *server, int close_server, int print_logs)
         // fprintf(stdout, "[Server:%d] Got connection from %s\n", port, s);
 
         // create thread to handle the new request
-        struct thread_payload *payload = (struct thread_payload *)malloc(sizeof(struct thread_payload));
+        struct thread_payload *payload = (struct thread_payload *)pool_alloc(payload_pool);
+        if (payload == NULL)
+        {
+            log_error("[Server:%d] Could not allocate a payload for the connection.\n", server->port);
+            close(new_socket_fd);
+            continue;
+        }
+        access_log_address((struct sockaddr *)&client_addr, payload->address);
+        clock_gettime(CLOCK_MONOTONIC, &payload->accepted);
         payload->new_socket_fd = new_socket_fd;
         payload->server = server;
+        payload->pool = payload_pool;
+        payload->trace_id = trace_sample(server->trace);
 
         // enqueue the new connection to the shared queue
+        trace_request = payload->trace_id;
+        if (trace_request != 0)
+        {
+            trace_record(trace_thread, TRACE_ACCEPT, trace_request, accept_start, trace_ns(&payload->accepted));
+        }
+        uint64_t span = trace_begin();
         queue_manager(ctx, 0, payload, -1);
+        trace_end(TRACE_ENQUEUE, span);
+        trace_request = 0;
         // pthread_mutex_lock(&queue->mutex);
         // enqueue(queue, payload);
         // pthread_mutex_unlock(&queue->mutex);
@@ -926,7 +2445,30 @@ void server_start(http_server *server, int close_server, int print_logs)
     // printf("Destroying queue\n");
     queue_destroy(queue);
     queue = NULL;
+    // the queues go away with the context. Their statistics stay with the server
+    for (int i = 0; i < ctx->num_queues; i++)
+    {
+        lockstat_add(&server->queue_lock_stats, &ctx->multi_queue[i]->mutex_stats);
+    }
+    server->queue_ctx = NULL;
     queue_manager_ctx_destroy(ctx);
+    pool_destroy(payload_pool);
+    // the workers stopped appending. The writer takes what is left in the rings
+    access_log_close(server->access_log);
+    server->access_log = NULL;
+    output_loop_destroy(server->output);
+    server->output = NULL;
+    // responses still in flight keep their cache entries until the reaper lets go of them
+    zerocopy_reaper_destroy(server->zerocopy);
+    server->zerocopy = NULL;
+    if (server->trace != NULL)
+    {
+        signal(SIGUSR1, SIG_DFL);
+        trace_thread = NULL;
+        trace_destroy(server->trace);
+        server->trace = NULL;
+    }
+    log_stop();
 
     // restore socket to be blocking
     if (fcntl(server->socket_fd, F_SETFL, flags_before) == -1)
@@ -944,6 +2486,18 @@ void server_start(http_server *server, int close_server, int print_logs)
     }
 }
 
+static void print_route_stats(route_node *node, void *stream)
+{
+    const route_stats *stats = node->stats;
+    if (stats->requests == 0)
+    {
+        return;
+    }
+    fprintf(
+        (FILE *)stream, "%-24s %10lu %14lu %10.1f %10.1f %12.3f\n", node->key, (unsigned long)stats->requests, (unsigned long)stats->bytes_sent,
+        histogram_percentile(&stats->latency, 50) / 1000.0, histogram_percentile(&stats->latency, 99) / 1000.0, stats->cpu_ns / 1e6);
+}
+
 void print_server_logs(http_server *server)
 {
     fprintf(stdout, "Server Port: %d\n", server->port);
@@ -960,6 +2514,7 @@ void print_server_logs(http_server *server)
 
     fprintf(stdout, "Server Directory: %s\n", server->server_root_dir);
     fprintf(stdout, "Number of Routes: %d\n", server->route_table->num_routes);
+    fprintf(stdout, "Number of Mounts: %d\n", server->route_table->num_mounts);
     fprintf(stdout, "Max Request size: %ld\n", server->max_request_size);
     fprintf(stdout, "Max Response size: %ld\n", server->max_response_size);
     fprintf(stdout, "Server Backlog: %d\n", server->backlog);
@@ -974,6 +2529,19 @@ void print_server_logs(http_server *server)
     fprintf(stdout, "(%ld GB; %ld MB; %ld KB; %ld B)\n", sent_bytes[0], sent_bytes[1], sent_bytes[2], sent_bytes[3]);
     fprintf(stdout, "Number of GET Requests Received: %d\n", server->server_logs->num_get_requests);
     fprintf(stdout, "Number of Requests Served: %d\n", server->server_logs->num_requests_served);
+    server_stats_print(server->stats, stdout);
+    fprintf(stdout, "%-24s %10s %14s %10s %10s %12s\n", "Route", "requests", "bytes", "p50(us)", "p99(us)", "cpu(ms)");
+    route_foreach(server->route_table, print_route_stats, stdout);
+#ifdef CSERVE_LOCKSTAT
+    fprintf(stdout, "%-24s %14s %12s %12s %12s\n", "Lock", "acquisitions", "contended", "wait(ms)", "hold(ms)");
+    for (int i = 0; i < SERVER_LOCK_COUNT; i++)
+    {
+        lock_stats stats;
+        server_lock_stats(server, i, &stats);
+        fprintf(stdout, "%-24s %14lu %12lu %12.3f %12.3f\n", server_lock_name(i), (unsigned long)stats.acquisitions,
+                (unsigned long)stats.contended, stats.wait_ns / 1e6, stats.hold_ns / 1e6);
+    }
+#endif
 }
 
 void destroy_server(http_server *server, int print_logs)
@@ -988,6 +2556,15 @@ void destroy_server(http_server *server, int print_logs)
         destroy_cache(server->cache);
     if (server->route_table)
         route_destroy(server->route_table);
+    if (server->cache_policies)
+        cache_policy_map_destroy(server->cache_policies);
+    if (server->assets)
+        asset_map_destroy(server->assets);
+    if (server->stats)
+        server_stats_destroy(server->stats);
+    free(server->metrics_path);
+    free(server->access_log_path);
+    free(server->trace_path);
     close(server->socket_fd);
     if (server)
         free(server);
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+
+static const char *stage_names[STATS_NUM_STAGES] = {"parse", "search", "response", "total"};
+
+void route_stats_record(route_stats *stats, uint64_t bytes_sent, uint64_t latency_ns, uint64_t cpu_ns)
+{
+    __atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_sent, bytes_sent, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->cpu_ns, cpu_ns, __ATOMIC_RELAXED);
+    histogram_add(&stats->latency, latency_ns);
+}
+
+/* Allocates zeroed statistics for num_workers workers. Returns NULL on error. */
+server_stats *server_stats_create(int num_workers)
+{
+    server_stats *stats = (server_stats *)malloc(sizeof(server_stats));
+    if (stats == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to server_stats.\n");
+        return NULL;
+    }
+    if (posix_memalign((void **)&stats->workers, STATS_CACHE_LINE, num_workers * sizeof(worker_stats)) != 0)
+    {
+        fprintf(stderr, "Error allocating memory to worker_stats.\n");
+        free(stats);
+        return NULL;
+    }
+    memset(stats->workers, 0, num_workers * sizeof(worker_stats));
+    stats->num_workers = num_workers;
+    return stats;
+}
+
+worker_stats *server_stats_worker(server_stats *stats, int rank)
+{
+    return stats != NULL && rank >= 0 && rank < stats->num_workers ? &stats->workers[rank] : NULL;
+}
+
+/* Returns the sum of counter over all workers. */
+uint64_t server_stats_counter(server_stats *stats, int counter)
+{
+    uint64_t total = 0;
+    for (int i = 0; stats != NULL && i < stats->num_workers; i++)
+    {
+        total += __atomic_load_n(&stats->workers[i].counters[counter], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/* Adds the latency of stage measured by every worker to merged, which the caller zeroes. */
+void server_stats_latency(server_stats *stats, int stage, histogram *merged)
+{
+    for (int i = 0; stats != NULL && i < stats->num_workers; i++)
+    {
+        histogram_merge(merged, &stats->workers[i].latency[stage]);
+    }
+}
+
+/* Adds the queue wait of the workers first_worker to first_worker + num_workers - 1 to merged. */
+void server_stats_queue_wait(server_stats *stats, int first_worker, int num_workers, histogram *merged)
+{
+    for (int i = first_worker; stats != NULL && i < first_worker + num_workers && i < stats->num_workers; i++)
+    {
+        histogram_merge(merged, &stats->workers[i].queue_wait);
+    }
+}
+
+const char *server_stats_stage_name(int stage)
+{
+    return stage >= 0 && stage < STATS_NUM_STAGES ? stage_names[stage] : NULL;
+}
+
+/* Prints the tail latency of every stage in microseconds. */
+void server_stats_print(server_stats *stats, FILE *stream)
+{
+    // a histogram is too large for the stack of every caller
+    histogram *merged = (histogram *)malloc(sizeof(histogram));
+    if (stats == NULL || merged == NULL)
+    {
+        free(merged);
+        return;
+    }
+    fprintf(stream, "%-10s %10s %10s %10s %10s %10s %10s\n", "Latency", "requests", "mean(us)", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (int stage = 0; stage < STATS_NUM_STAGES; stage++)
+    {
+        memset(merged, 0, sizeof(histogram));
+        server_stats_latency(stats, stage, merged);
+        fprintf(
+            stream, "%-10s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stage_names[stage], (unsigned long)merged->count,
+            histogram_mean(merged) / 1000, histogram_percentile(merged, 50) / 1000.0, histogram_percentile(merged, 99) / 1000.0,
+            histogram_percentile(merged, 99.9) / 1000.0, merged->max / 1000.0);
+    }
+    // time spent waiting for a worker comes before all stages
+    memset(merged, 0, sizeof(histogram));
+    server_stats_queue_wait(stats, 0, stats->num_workers, merged);
+    fprintf(
+        stream, "%-10s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", "queue", (unsigned long)merged->count,
+        histogram_mean(merged) / 1000, histogram_percentile(merged, 50) / 1000.0, histogram_percentile(merged, 99) / 1000.0,
+        histogram_percentile(merged, 99.9) / 1000.0, merged->max / 1000.0);
+    free(merged);
+}
+
+void server_stats_destroy(server_stats *stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    free(stats->workers);
+    free(stats);
+}
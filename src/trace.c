@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+__thread trace_buffer *trace_thread = NULL;
+__thread uint32_t trace_request = 0;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+static const char *trace_event_names[TRACE_EVENT_COUNT] = {
+    "accept", "enqueue", "dequeue", "request", "parse",
+    "route lookup", "cache lookup", "file load", "handler", "send"};
+
+/*
+ * Creates a tracer with num_buffers thread buffers, recording one in
+ * sample_rate connections. Returns NULL on error.
+ */
+tracer *trace_create(int num_buffers, int sample_rate)
+{
+    tracer *trace = (tracer *)malloc(sizeof(tracer));
+    if (trace == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to tracer.\n");
+        return NULL;
+    }
+    trace->buffers = (trace_buffer *)calloc(num_buffers, sizeof(trace_buffer));
+    if (trace->buffers == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to trace buffers.\n");
+        free(trace);
+        return NULL;
+    }
+    trace->num_buffers = num_buffers;
+    trace->sample_rate = sample_rate > 0 ? sample_rate : 1;
+    trace->num_connections = 0;
+    trace->next_request = 0;
+    return trace;
+}
+
+/* Returns the buffer at index, named after the thread that records into it. */
+trace_buffer *trace_buffer_get(tracer *trace, int index, const char *name)
+{
+    if (trace == NULL || index < 0 || index >= trace->num_buffers)
+    {
+        return NULL;
+    }
+    trace_buffer *buffer = &trace->buffers[index];
+    snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+    return buffer;
+}
+
+/* Decides whether a new connection is traced. Returns its request id, or 0. Call from one thread only. */
+uint32_t trace_sample(tracer *trace)
+{
+    if (trace == NULL || trace->num_connections++ % trace->sample_rate != 0)
+    {
+        return 0;
+    }
+    if (++trace->next_request == 0)
+    {
+        trace->next_request = 1;
+    }
+    return trace->next_request;
+}
+
+/* Records a span into the buffer of the calling thread. */
+void trace_record(trace_buffer *buffer, int event, uint32_t request, uint64_t start, uint64_t end)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+    uint64_t head = buffer->head;
+    trace_span *span = &buffer->spans[head & (TRACE_BUFFER_SPANS - 1)];
+    span->start = start;
+    span->duration = end > start ? end - start : 0;
+    span->request = request;
+    span->event = event;
+    __atomic_store_n(&buffer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_signal_handler(int signum)
+{
+    (void)signum;
+    trace_dump_requested = 1;
+}
+
+/*
+ * Writes the spans of every buffer to path in the Chrome trace event format,
+ * which chrome://tracing and Perfetto open. Spans of one request are joined
+ * across threads by a flow from enqueue to dequeue. Returns 0, or -1 on error.
+ */
+int trace_dump(tracer *trace, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror("Could not write the trace");
+        return -1;
+    }
+    trace_span *spans = (trace_span *)malloc(TRACE_BUFFER_SPANS * sizeof(trace_span));
+    if (spans == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to trace dump.\n");
+        fclose(file);
+        return -1;
+    }
+    int pid = getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"cServe\"}}", pid);
+    for (int i = 0; i < trace->num_buffers; i++)
+    {
+        trace_buffer *buffer = &trace->buffers[i];
+        if (buffer->name[0] == '\0')
+        {
+            continue;
+        }
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, i, buffer->name);
+
+        uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        uint64_t copied = head > TRACE_BUFFER_SPANS ? head - TRACE_BUFFER_SPANS : 0;
+        for (uint64_t j = copied; j < head; j++)
+        {
+            spans[j - copied] = buffer->spans[j & (TRACE_BUFFER_SPANS - 1)];
+        }
+        // the thread kept recording while the spans were copied. Skip the ones it overwrote,
+        // and the slot at the new head, which it may have been writing during the copy
+        uint64_t valid = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        valid = valid >= TRACE_BUFFER_SPANS ? valid - TRACE_BUFFER_SPANS + 1 : 0;
+        for (uint64_t j = valid > copied ? valid : copied; j < head; j++)
+        {
+            trace_span *span = &spans[j - copied];
+            if (span->event >= TRACE_EVENT_COUNT)
+            {
+                continue;
+            }
+            double ts = span->start / 1e3, dur = span->duration / 1e3;
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%u}}",
+                    trace_event_names[span->event], pid, i, ts, dur, span->request);
+            if (span->event == TRACE_ENQUEUE)
+            {
+                fprintf(file, ",\n{\"name\":\"connection\",\"cat\":\"request\",\"ph\":\"s\",\"id\":%u,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", span->request, pid, i, ts);
+            }
+            else if (span->event == TRACE_DEQUEUE)
+            {
+                fprintf(file, ",\n{\"name\":\"connection\",\"cat\":\"request\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%u,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", span->request, pid, i, ts + dur);
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+    free(spans);
+    if (fclose(file) != 0)
+    {
+        perror("Could not write the trace");
+        return -1;
+    }
+    return 0;
+}
+
+void trace_destroy(tracer *trace)
+{
+    if (trace == NULL)
+    {
+        return;
+    }
+    free(trace->buffers);
+    free(trace);
+}
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "zerocopy.h"
+#include "log.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#define ZEROCOPY_MAX_EVENTS 64
+#define ZEROCOPY_POLL_INTERVAL 100 // ms
+
+/* Allows MSG_ZEROCOPY sends on socket_fd. Returns 0, or -1 if the kernel does not support them. */
+int zerocopy_enable(int socket_fd)
+{
+    int one = 1;
+    return setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+/*
+ * Sends all of iov with MSG_ZEROCOPY, continuing after partial writes. The
+ * kernel reads the buffers while transmitting, after this returns; they must
+ * not change until all num_sends sends completed. num_sends is set even on error.
+ * It stops early on a non-blocking socket once the socket is full, and with
+ * ENOBUFS once the notifications pending on the socket use up its option
+ * memory. The caller sends the rest without MSG_ZEROCOPY.
+ * Returns the number of bytes written, or -1.
+ */
+long zerocopy_send(int socket_fd, struct iovec *iov, int iovcnt, uint32_t *num_sends)
+{
+    long total = 0;
+    *num_sends = 0;
+    while (iovcnt > 0)
+    {
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        long rv = sendmsg(socket_fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                return total;
+            log_warn("Could not send response: %s\n", strerror(errno));
+            return total > 0 ? total : -1;
+        }
+        (*num_sends)++;
+        total += rv;
+        while (iovcnt > 0 && (size_t)rv >= iov->iov_len)
+        {
+            rv -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+    return total;
+}
+
+/* Counts the completions queued on the socket. Returns 1 once all sends completed. */
+static int zerocopy_read_completions(zerocopy_pending *pending)
+{
+    char control[128];
+    for (;;)
+    {
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(pending->socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            break;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+            {
+                // ee_info to ee_data is the inclusive range of sends that completed
+                pending->num_completed += err->ee_data - err->ee_info + 1;
+            }
+        }
+    }
+    return pending->num_completed >= pending->num_sends;
+}
+
+// call with reaper->lock held
+static void zerocopy_unlink(zerocopy_reaper *reaper, zerocopy_pending *pending)
+{
+    if (pending->prev)
+        pending->prev->next = pending->next;
+    else
+        reaper->pending = pending->next;
+    if (pending->next)
+        pending->next->prev = pending->prev;
+    reaper->num_pending--;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// waits on the calling thread until the kernel lets go of the buffers, at most ZEROCOPY_DRAIN_TIMEOUT
+static void zerocopy_wait(zerocopy_pending *pending)
+{
+    long deadline = now_ms() + ZEROCOPY_DRAIN_TIMEOUT;
+    while (!zerocopy_read_completions(pending) && now_ms() < deadline)
+    {
+        poll(&(struct pollfd){pending->socket_fd, 0, 0}, 1, ZEROCOPY_POLL_INTERVAL);
+    }
+}
+
+// unlinks pending, closes its socket and hands its buffers back. Call with reaper->lock held
+static void zerocopy_finish(zerocopy_reaper *reaper, zerocopy_pending *pending)
+{
+    epoll_ctl(reaper->epoll_fd, EPOLL_CTL_DEL, pending->socket_fd, NULL);
+    zerocopy_unlink(reaper, pending);
+    close(pending->socket_fd);
+    pending->done(pending->arg);
+    free(pending);
+}
+
+static void *zerocopy_reaper_loop(void *arg)
+{
+    zerocopy_reaper *reaper = (zerocopy_reaper *)arg;
+    struct epoll_event events[ZEROCOPY_MAX_EVENTS];
+    long deadline = -1;
+
+    for (;;)
+    {
+        if (!__atomic_load_n(&reaper->running, __ATOMIC_ACQUIRE))
+        {
+            // stopping. Give the sends in flight a moment before giving up on them
+            if (deadline < 0)
+                deadline = now_ms() + ZEROCOPY_DRAIN_TIMEOUT;
+            pthread_mutex_lock(&reaper->lock);
+            int num_pending = reaper->num_pending;
+            pthread_mutex_unlock(&reaper->lock);
+            if (num_pending == 0 || now_ms() >= deadline)
+                break;
+        }
+
+        int n = epoll_wait(reaper->epoll_fd, events, ZEROCOPY_MAX_EVENTS, ZEROCOPY_POLL_INTERVAL);
+        pthread_mutex_lock(&reaper->lock);
+        for (int i = 0; i < n; i++)
+        {
+            zerocopy_pending *pending = (zerocopy_pending *)events[i].data.ptr;
+            if (zerocopy_read_completions(pending))
+            {
+                zerocopy_finish(reaper, pending);
+            }
+        }
+        pthread_mutex_unlock(&reaper->lock);
+    }
+    return NULL;
+}
+
+/* Starts the thread that waits for completions. Returns NULL on error. */
+zerocopy_reaper *zerocopy_reaper_create()
+{
+    zerocopy_reaper *reaper = (zerocopy_reaper *)malloc(sizeof(zerocopy_reaper));
+    if (reaper == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to zerocopy_reaper.\n");
+        return NULL;
+    }
+    reaper->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reaper->epoll_fd < 0)
+    {
+        perror("Could not create epoll instance for zerocopy completions");
+        free(reaper);
+        return NULL;
+    }
+    reaper->running = 1;
+    reaper->lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    reaper->pending = NULL;
+    reaper->num_pending = 0;
+    if (pthread_create(&reaper->thread, NULL, zerocopy_reaper_loop, reaper) != 0)
+    {
+        fprintf(stderr, "Could not start the zerocopy completion thread.\n");
+        close(reaper->epoll_fd);
+        free(reaper);
+        return NULL;
+    }
+    return reaper;
+}
+
+/*
+ * Hands the sends in flight on socket_fd to the reaper. The reaper keeps its
+ * own duplicate of the socket, so the caller may close socket_fd right away.
+ * done(arg) is called, possibly on the reaper's thread, once every send completed.
+ * If the socket cannot be watched, the completions are awaited here instead.
+ */
+void zerocopy_reaper_add(zerocopy_reaper *reaper, int socket_fd, uint32_t num_sends, void (*done)(void *), void *arg)
+{
+    zerocopy_pending *pending = (zerocopy_pending *)malloc(sizeof(zerocopy_pending));
+    int fd = dup(socket_fd);
+    if (pending == NULL || fd < 0)
+    {
+        fprintf(stderr, "Could not hand zerocopy sends to the reaper. Waiting for them.\n");
+        zerocopy_pending local = {socket_fd, num_sends, 0, done, arg, NULL, NULL};
+        zerocopy_wait(&local);
+        if (fd >= 0)
+            close(fd);
+        free(pending);
+        done(arg);
+        return;
+    }
+    pending->socket_fd = fd;
+    pending->num_sends = num_sends;
+    pending->num_completed = 0;
+    pending->done = done;
+    pending->arg = arg;
+    pending->prev = NULL;
+
+    pthread_mutex_lock(&reaper->lock);
+    pending->next = reaper->pending;
+    if (reaper->pending)
+        reaper->pending->prev = pending;
+    reaper->pending = pending;
+    reaper->num_pending++;
+    // errors are always reported. Edge triggered, so a socket the peer closed does not spin the loop
+    struct epoll_event event = {.events = EPOLLERR | EPOLLET, .data.ptr = pending};
+    if (epoll_ctl(reaper->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0)
+    {
+        pthread_mutex_unlock(&reaper->lock);
+        return;
+    }
+    perror("Could not watch socket for zerocopy completions");
+    zerocopy_unlink(reaper, pending);
+    pthread_mutex_unlock(&reaper->lock);
+
+    zerocopy_wait(pending);
+    close(fd);
+    done(arg);
+    free(pending);
+}
+
+/*
+ * Stops the reaper after waiting up to ZEROCOPY_DRAIN_TIMEOUT for the sends
+ * in flight. Whatever is still pending then is closed and handed back.
+ */
+void zerocopy_reaper_destroy(zerocopy_reaper *reaper)
+{
+    if (reaper == NULL)
+    {
+        return;
+    }
+    __atomic_store_n(&reaper->running, 0, __ATOMIC_RELEASE);
+    pthread_join(reaper->thread, NULL);
+
+    pthread_mutex_lock(&reaper->lock);
+    while (reaper->pending != NULL)
+    {
+        zerocopy_finish(reaper, reaper->pending);
+    }
+    pthread_mutex_unlock(&reaper->lock);
+    close(reaper->epoll_fd);
+    free(reaper);
+}
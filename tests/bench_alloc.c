@@ -0,0 +1,161 @@
+/*
+ * Counts heap allocations made by the server per request.
+ *
+ * malloc and friends are interposed for the whole process, including
+ * libcserve.so. The server runs on a background thread and is warmed up
+ * (cache filled, pools grown) before the measured requests are made.
+ *
+ * Build and run:
+ *   make bench && LD_LIBRARY_PATH=. ./build/bench_alloc
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "server.h"
+
+#define BENCH_PORT 18080
+#define BENCH_WARMUP 200
+#define BENCH_REQUESTS 2000
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static long num_allocations = 0;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&num_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&num_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&num_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+void route_fn(void *server, int new_socket_fd, const char *path, void *args)
+{
+    char body[] = "hello";
+    send_http_response(server, new_socket_fd, HEADER_OK, "text/plain", body, strlen(body));
+}
+
+void *server_thread(void *arg)
+{
+    server_start((http_server *)arg, 1, 0);
+    return NULL;
+}
+
+/* Sends one request and reads the response until the server closes the connection. */
+int do_request(const char *path)
+{
+    char buffer[65536];
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        return -1;
+    }
+    int length = snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\nAccept: */*\r\n\r\n", path);
+    if (send(fd, buffer, length, 0) != length)
+    {
+        close(fd);
+        return -1;
+    }
+    long total = 0, n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+    {
+        total += n;
+    }
+    close(fd);
+    return total > 0 ? 0 : -1;
+}
+
+int run(const char *name, const char *path)
+{
+    for (int i = 0; i < BENCH_WARMUP; i++)
+    {
+        if (do_request(path) < 0)
+        {
+            fprintf(stderr, "%s: request failed\n", name);
+            return -1;
+        }
+    }
+    // let the workers finish the last warmup request
+    usleep(100 * 1000);
+
+    long start = __atomic_load_n(&num_allocations, __ATOMIC_RELAXED);
+    for (int i = 0; i < BENCH_REQUESTS; i++)
+    {
+        do_request(path);
+    }
+    usleep(100 * 1000);
+    long allocations = __atomic_load_n(&num_allocations, __ATOMIC_RELAXED) - start;
+
+    fprintf(stdout, "%-24s %8d requests %8ld allocations %8.3f allocations/request\n", name, BENCH_REQUESTS, allocations, (double)allocations / BENCH_REQUESTS);
+    return 0;
+}
+
+int main()
+{
+    char root[] = "/tmp/cserve-bench-XXXXXX";
+    char filepath[256];
+    if (mkdtemp(root) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(filepath, sizeof(filepath), "%s/index.html", root);
+    FILE *fp = fopen(filepath, "w");
+    for (int i = 0; i < 256; i++)
+    {
+        fputs("<p>cServe allocation benchmark</p>\n", fp);
+    }
+    fclose(fp);
+
+    char *methods[1] = {"GET"};
+    http_server *server = create_server(BENCH_PORT, 16, 16, root, 0, 0, 1000);
+    server_route(server, "/route", NULL, methods, 1, "/", route_fn, NULL);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_thread, server);
+    usleep(200 * 1000);
+
+    fprintf(stdout, "\n");
+    int rv = 0;
+    rv |= run("cached file", "/index.html");
+    rv |= run("custom route", "/route");
+    rv |= run("not found", "/missing/path");
+
+    raise(SIGINT);
+    pthread_join(thread, NULL);
+    unlink(filepath);
+    rmdir(root);
+    return rv ? 1 : 0;
+}
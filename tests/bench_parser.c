@@ -0,0 +1,144 @@
+/*
+ * Measures the request parser with every character scanner the CPU supports.
+ *
+ * The requests are header sets captured from desktop browsers loading a page
+ * and its assets. Each variant parses all of them in a loop and the best of
+ * several rounds is reported.
+ *
+ * Build and run:
+ *   make bench && LD_LIBRARY_PATH=. ./build/bench_parser
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "picohttpparser.h"
+#include "http.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_ITERATIONS 200000
+
+static const char *requests[] = {
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: _ga=GA1.1.1417203374.1697031234; session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "\r\n",
+
+    "GET /assets/css/main.css?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/119.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-Modified-Since: Tue, 10 Oct 2023 08:12:31 GMT\r\n"
+    "If-None-Match: \"5f2c-1a9e3b7c\"\r\n"
+    "\r\n",
+
+    "GET /images/pic.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 Safari/605.1.15\r\n"
+    "Accept: image/webp,image/avif,image/jxl,image/heic,image/heic-sequence,video/*;q=0.8,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+};
+
+#define NUM_REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the best time per request over BENCH_ROUNDS, or -1 if a request does not parse. */
+static double run(void)
+{
+    size_t lengths[NUM_REQUESTS];
+    for (size_t i = 0; i < NUM_REQUESTS; i++)
+    {
+        lengths[i] = strlen(requests[i]);
+    }
+
+    double best = -1;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        double start = now_ns();
+        for (int n = 0; n < BENCH_ITERATIONS; n++)
+        {
+            for (size_t i = 0; i < NUM_REQUESTS; i++)
+            {
+                const char *method, *path;
+                size_t method_len, path_len, num_headers = HTTP_MAX_HEADERS;
+                int minor_version;
+                struct phr_header headers[HTTP_MAX_HEADERS];
+                int pret = phr_parse_request(requests[i], lengths[i], &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers, 0);
+                if (pret != (int)lengths[i])
+                {
+                    return -1;
+                }
+                __asm__ __volatile__("" : : "r"(headers) : "memory");
+            }
+        }
+        double elapsed = (now_ns() - start) / ((double)BENCH_ITERATIONS * NUM_REQUESTS);
+        if (best < 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+int main()
+{
+    size_t total = 0;
+    for (size_t i = 0; i < NUM_REQUESTS; i++)
+    {
+        total += strlen(requests[i]);
+    }
+    fprintf(stdout, "\n%zu requests, %zu bytes on average\n", NUM_REQUESTS, total / NUM_REQUESTS);
+
+    int default_simd = phr_simd_current();
+    int rv = 0;
+    for (int simd = 0; simd < PHR_SIMD_COUNT; simd++)
+    {
+        if (phr_simd_select(simd) < 0)
+        {
+            fprintf(stdout, "%-8s not supported by this CPU\n", phr_simd_name(simd));
+            continue;
+        }
+        double ns = run();
+        if (ns < 0)
+        {
+            fprintf(stderr, "%s: request failed to parse\n", phr_simd_name(simd));
+            rv = 1;
+            continue;
+        }
+        fprintf(stdout, "%-8s %8.1f ns/request %8.2f GB/s%s\n", phr_simd_name(simd), ns, (total / NUM_REQUESTS) / ns, simd == default_simd ? "  (default on load)" : "");
+    }
+    fprintf(stdout, "selected by http_parser_calibrate(): %s\n", phr_simd_name(http_parser_calibrate()));
+    return rv;
+}
@@ -0,0 +1,159 @@
+/*
+ * Checks that a precompressed copy served for its original file and the same
+ * copy requested by name do not share a cache entry. Each order of the two
+ * requests runs against its own mount, so it starts with an empty entry.
+ *
+ * Build and run:
+ *   make check
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "server.h"
+
+#define CHECK_PORT 18081
+#define CHECK_GZIP "\x1f\x8b\x08\x00compressed"
+
+static int failures = 0;
+
+void *server_thread(void *arg)
+{
+    server_start((http_server *)arg, 1, 0);
+    return NULL;
+}
+
+/* Sends one request and reads the response into buffer until the server closes the connection. */
+long do_request(const char *path, const char *headers, char *buffer, size_t size)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CHECK_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        return -1;
+    }
+    char request[1024];
+    int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", path, headers);
+    if (send(fd, request, length, 0) != length)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t total = 0;
+    long n;
+    while (total < size - 1 && (n = recv(fd, buffer + total, size - 1 - total, 0)) > 0)
+    {
+        total += n;
+    }
+    close(fd);
+    buffer[total] = '\0';
+    return total;
+}
+
+/*
+ * Requests path and checks the Content-Type, whether the response carries
+ * Content-Encoding: gzip and Vary, and that the body is the gzip copy.
+ */
+void check_response(const char *order, const char *path, const char *headers, const char *content_type, int encoded)
+{
+    char response[4096], expected[128];
+    if (do_request(path, headers, response, sizeof(response)) < 0)
+    {
+        fprintf(stderr, "FAIL %s: request for %s failed\n", order, path);
+        failures++;
+        return;
+    }
+    snprintf(expected, sizeof(expected), "Content-Type: %s\n", content_type);
+    char *body = strstr(response, "\n\n");
+    const char *problem = NULL;
+    if (strncmp(response, "HTTP/1.1 200", 12) != 0)
+        problem = "status is not 200";
+    else if (strstr(response, expected) == NULL)
+        problem = "wrong Content-Type";
+    else if ((strstr(response, "Content-Encoding: gzip\n") != NULL) != encoded)
+        problem = encoded ? "Content-Encoding missing" : "unexpected Content-Encoding";
+    else if ((strstr(response, "Vary: Accept-Encoding\n") != NULL) != encoded)
+        problem = encoded ? "Vary missing" : "unexpected Vary";
+    else if (body == NULL || strcmp(body + 2, CHECK_GZIP) != 0)
+        problem = "body is not the gzip copy";
+    if (problem != NULL)
+    {
+        fprintf(stderr, "FAIL %s: %s for %s\n%s\n", order, problem, path, response);
+        failures++;
+    }
+}
+
+void write_file(const char *dir, const char *name, const char *content)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "w");
+    fputs(content, fp);
+    fclose(fp);
+}
+
+int main()
+{
+    char root[] = "/tmp/cserve-check-XXXXXX";
+    char dirs[2][256];
+    if (mkdtemp(root) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        snprintf(dirs[i], sizeof(dirs[i]), "%s/%s", root, i == 0 ? "first" : "second");
+        mkdir(dirs[i], 0755);
+        write_file(dirs[i], "main.css", "body { color: black; }\n");
+        write_file(dirs[i], "main.css.gz", CHECK_GZIP);
+    }
+
+    http_server *server = create_server(CHECK_PORT, 16, 16, root, 0, 0, 1000);
+    server_mount(server, "/first", "first", MOUNT_CACHE);
+    server_mount(server, "/second", "second", MOUNT_CACHE);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_thread, server);
+    usleep(200 * 1000);
+
+    const char *gzip = "Accept-Encoding: gzip\r\n";
+    check_response("gz file first", "/first/main.css.gz", "", "application/octet-stream", 0);
+    check_response("gz file first", "/first/main.css", gzip, "text/css", 1);
+    check_response("gz file first", "/first/main.css.gz", "", "application/octet-stream", 0);
+
+    check_response("negotiated first", "/second/main.css", gzip, "text/css", 1);
+    check_response("negotiated first", "/second/main.css.gz", "", "application/octet-stream", 0);
+    check_response("negotiated first", "/second/main.css", gzip, "text/css", 1);
+
+    raise(SIGINT);
+    pthread_join(thread, NULL);
+    for (int i = 0; i < 2; i++)
+    {
+        char path[300];
+        snprintf(path, sizeof(path), "%s/main.css", dirs[i]);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/main.css.gz", dirs[i]);
+        unlink(path);
+        rmdir(dirs[i]);
+    }
+    rmdir(root);
+
+    if (failures == 0)
+    {
+        printf("check_encoding: all checks passed\n");
+    }
+    return failures;
+}
@@ -0,0 +1,143 @@
+/*
+ * Checks the parsers that guard the server root and pick byte ranges:
+ * http_path_normalize() and http_parse_range(). Every case prints a line
+ * only if it fails; the exit status is the number of failures.
+ *
+ * Build and run:
+ *   make check
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "http.h"
+
+static int failures = 0;
+
+// expected is the normalized path, or NULL if the path must be rejected
+static void check_path(const char *path, const char *expected)
+{
+    char buffer[256];
+    size_t len = strlen(path);
+    memcpy(buffer, path, len + 1);
+    long rv = http_path_normalize(buffer, len);
+    if (expected == NULL ? rv != -1 : rv < 0 || (size_t)rv != strlen(expected) || strcmp(buffer, expected) != 0)
+    {
+        fprintf(stderr, "FAIL path \"%s\": got %ld \"%s\", expected \"%s\"\n", path, rv, rv < 0 ? "" : buffer, expected ? expected : "(rejected)");
+        failures++;
+    }
+}
+
+// expected holds num_expected ranges as start, end pairs
+static void check_range(const char *value, size_t size, int num_expected, const size_t *expected)
+{
+    http_range ranges[HTTP_MAX_RANGES];
+    int rv = http_parse_range(value, strlen(value), size, ranges, HTTP_MAX_RANGES);
+    int ok = rv == num_expected;
+    for (int i = 0; ok && i < rv; i++)
+    {
+        ok = ranges[i].start == expected[2 * i] && ranges[i].end == expected[2 * i + 1];
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "FAIL range \"%s\" of %zu bytes: got %d", value, size, rv);
+        for (int i = 0; i < rv; i++)
+        {
+            fprintf(stderr, " %zu-%zu", ranges[i].start, ranges[i].end);
+        }
+        fprintf(stderr, ", expected %d", num_expected);
+        for (int i = 0; i < num_expected; i++)
+        {
+            fprintf(stderr, " %zu-%zu", expected[2 * i], expected[2 * i + 1]);
+        }
+        fprintf(stderr, "\n");
+        failures++;
+    }
+}
+
+#define RANGES(...) ((const size_t[]){__VA_ARGS__})
+
+int main()
+{
+    // canonical paths are left alone
+    check_path("/", "/");
+    check_path("/index.html", "/index.html");
+    check_path("/assets/css/", "/assets/css/");
+    // dot segments
+    check_path("/./index.html", "/index.html");
+    check_path("/assets/../index.html", "/index.html");
+    check_path("/a/b/../../c", "/c");
+    check_path("/a/..", "/");
+    check_path("/..", NULL);
+    check_path("/../etc/passwd", NULL);
+    check_path("/a/../../etc/passwd", NULL);
+    check_path("/...", "/...");
+    // encoded dots and slashes are decoded before the segments are resolved
+    check_path("/%2e%2e/etc/passwd", NULL);
+    check_path("/%2E%2e/etc/passwd", NULL);
+    check_path("/a/%2e%2e/%2e%2e/etc/passwd", NULL);
+    check_path("/a/%2e/b", "/a/b");
+    check_path("/a%2fb", "/a/b");
+    check_path("/a%2F..%2F..%2Fetc", NULL);
+    check_path("/a/b%2f..%2fc", "/a/c");
+    check_path("/hello%20world", "/hello world");
+    // NUL bytes and malformed escapes
+    check_path("/index.html%00.png", NULL);
+    check_path("/%00", NULL);
+    check_path("/a%2", NULL);
+    check_path("/a%zz", NULL);
+    check_path("/%", NULL);
+    // repeated slashes collapse
+    check_path("//index.html", "/index.html");
+    check_path("/assets//css///main.css", "/assets/css/main.css");
+    check_path("/assets//", "/assets/");
+    check_path("/%2f%2fetc", "/etc");
+    // relative paths
+    check_path("index.html", NULL);
+    check_path("", NULL);
+
+    // closed ranges, clamped to the last byte
+    check_range("bytes=0-99", 1000, 1, RANGES(0, 99));
+    check_range("bytes=500-999", 1000, 1, RANGES(500, 999));
+    check_range("bytes=500-5000", 1000, 1, RANGES(500, 999));
+    check_range("bytes=0-0", 1, 1, RANGES(0, 0));
+    // open ranges
+    check_range("bytes=900-", 1000, 1, RANGES(900, 999));
+    check_range("bytes=0-", 1000, 1, RANGES(0, 999));
+    // suffix ranges
+    check_range("bytes=-100", 1000, 1, RANGES(900, 999));
+    check_range("bytes=-5000", 1000, 1, RANGES(0, 999));
+    check_range("bytes=-0", 1000, 0, NULL);
+    // several ranges, with whitespace; unsatisfiable ones are dropped
+    check_range("bytes=0-9, 20-29,-5", 100, 3, RANGES(0, 9, 20, 29, 95, 99));
+    check_range("bytes=0-9,2000-3000", 100, 1, RANGES(0, 9));
+    // unsatisfiable
+    check_range("bytes=1000-", 1000, 0, NULL);
+    check_range("bytes=1000-2000", 1000, 0, NULL);
+    check_range("bytes=0-", 0, 0, NULL);
+    check_range("bytes=-10", 0, 0, NULL);
+    // malformed or unsupported, the header is ignored
+    check_range("bytes=", 1000, -1, NULL);
+    check_range("bytes=-", 1000, -1, NULL);
+    check_range("bytes=9-1", 1000, -1, NULL);
+    check_range("bytes=a-b", 1000, -1, NULL);
+    check_range("bytes=1-2-3", 1000, -1, NULL);
+    check_range("items=0-9", 1000, -1, NULL);
+    check_range("bytes 0-9", 1000, -1, NULL);
+    // values that do not fit a size_t
+    check_range("bytes=99999999999999999999999-", 1000, -1, NULL);
+    check_range("bytes=0-99999999999999999999999", 1000, -1, NULL);
+    check_range("bytes=-99999999999999999999999", 1000, -1, NULL);
+    // more ranges than HTTP_MAX_RANGES
+    char many[1024] = "bytes=0-0";
+    for (int i = 1; i <= HTTP_MAX_RANGES; i++)
+    {
+        snprintf(many + strlen(many), sizeof(many) - strlen(many), ",%d-%d", 2 * i, 2 * i);
+    }
+    check_range(many, 1000, -1, NULL);
+
+    if (failures == 0)
+    {
+        printf("check_http: all checks passed\n");
+    }
+    return failures;
+}
@@ -0,0 +1,163 @@
+/*
+ * Prints the binary access log written by server_access_log() as text, one
+ * request per line:
+ *
+ *     2024-01-31T12:00:00.123456Z 127.0.0.1 GET /index.html 200 1432 85us
+ *
+ * The log only stores a hash of each path. Paths listed in the file given
+ * with -p, one per line, are printed by name; all others as #<hash>.
+ *
+ * usage: cserve_logdump [-p paths] access.log
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "accesslog.h"
+#include "hash.h"
+#include "http.h"
+
+typedef struct known_path
+{
+    uint64_t hash;
+    char *path;
+} known_path;
+
+static int compare_paths(const void *a, const void *b)
+{
+    uint64_t x = ((const known_path *)a)->hash, y = ((const known_path *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* Reads the paths listed in filename. Returns them sorted by hash, or NULL on error. */
+static known_path *load_paths(const char *filename, size_t *num_paths)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror(filename);
+        return NULL;
+    }
+    size_t capacity = 64;
+    known_path *paths = (known_path *)malloc(capacity * sizeof(known_path));
+    char line[4096];
+    *num_paths = 0;
+    while (paths != NULL && fgets(line, sizeof(line), file) != NULL)
+    {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0)
+            continue;
+        if (*num_paths == capacity)
+        {
+            capacity *= 2;
+            known_path *grown = (known_path *)realloc(paths, capacity * sizeof(known_path));
+            if (grown == NULL)
+            {
+                free(paths);
+                paths = NULL;
+                break;
+            }
+            paths = grown;
+        }
+        paths[*num_paths].hash = hash64(line, len, 0);
+        paths[*num_paths].path = strdup(line);
+        (*num_paths)++;
+    }
+    fclose(file);
+    if (paths == NULL)
+    {
+        fprintf(stderr, "Error allocating memory to the path list.\n");
+        return NULL;
+    }
+    qsort(paths, *num_paths, sizeof(known_path), compare_paths);
+    return paths;
+}
+
+static void print_record(const access_record *record, const known_path *paths, size_t num_paths)
+{
+    char time_string[32], address[INET6_ADDRSTRLEN];
+    time_t seconds = record->timestamp / 1000000000UL;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    strftime(time_string, sizeof(time_string), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    static const uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (memcmp(record->address, v4_prefix, sizeof(v4_prefix)) == 0)
+        inet_ntop(AF_INET, record->address + 12, address, sizeof(address));
+    else
+        inet_ntop(AF_INET6, record->address, address, sizeof(address));
+
+    known_path key = {record->path_hash, NULL};
+    const known_path *path = paths ? (const known_path *)bsearch(&key, paths, num_paths, sizeof(known_path), compare_paths) : NULL;
+
+    printf("%s.%06luZ %s %s ", time_string, (unsigned long)(record->timestamp % 1000000000UL / 1000), address,
+           record->method < HTTP_METHOD_COUNT ? http_method_name((http_method)record->method) : "-");
+    if (path != NULL)
+        printf("%s", path->path);
+    else
+        printf("#%016lx", (unsigned long)record->path_hash);
+    printf(" %u %lu %uus\n", record->status, (unsigned long)record->bytes_sent, record->latency_us);
+}
+
+int main(int argc, char **argv)
+{
+    const char *paths_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:")) != -1)
+    {
+        if (opt == 'p')
+            paths_file = optarg;
+        else
+            break;
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-p paths] access.log\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    known_path *paths = NULL;
+    size_t num_paths = 0;
+    if (paths_file != NULL && (paths = load_paths(paths_file, &num_paths)) == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    FILE *log = fopen(argv[optind], "rb");
+    if (log == NULL)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    access_log_header header;
+    if (fread(&header, sizeof(header), 1, log) != 1 || memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "%s is not a cServe access log.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (header.record_size != sizeof(access_record))
+    {
+        fprintf(stderr, "%s has records of %u bytes, expected %zu.\n", argv[optind], header.record_size, sizeof(access_record));
+        return EXIT_FAILURE;
+    }
+
+    access_record records[1024];
+    size_t count;
+    while ((count = fread(records, sizeof(access_record), 1024, log)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            print_record(&records[i], paths, num_paths);
+        }
+    }
+    fclose(log);
+    for (size_t i = 0; i < num_paths; i++)
+    {
+        free(paths[i].path);
+    }
+    free(paths);
+    return EXIT_SUCCESS;
+}